@@ -1,8 +1,11 @@
-import os, stat, time, sys
+import os, stat, time, sys, threading, mmap, heapq, collections
 
-from twisted.internet import reactor, abstract, defer
+from zope.interface import implements
 
-from _aio import Queue as _aio_Queue, QueueError
+from twisted.internet import reactor, abstract, defer, interfaces
+from twisted.python import failure
+
+from _aio import Queue as _aio_Queue, QueueError, Buffer, Staging, sendfile, engines
 
 class KAIOFd(abstract.FileDescriptor):
     """
@@ -31,14 +34,48 @@ class KAIOFd(abstract.FileDescriptor):
         for a in buf:
             noEvents += ord(a) << shl
             shl += 8
-        return self.queue.processEvents(minEvents = noEvents, maxEvents = noEvents, timeoutNSec = 1)
+        # io_uring may signal several completions at once, so take
+        # everything that is in flight
+        maxEvents = max(noEvents, self.queue.busy)
+        # token completions are passed to queue.completionHandler in one
+        # call; the return value must not reach the reactor
+        self.queue.processEvents(minEvents = noEvents, maxEvents = maxEvents, timeoutNSec = 1)
     # return
 
+class KAIOReaper(threading.Thread):
+    """
+    Worker thread collecting completions of a queue with
+    Queue.reapEvents, which waits in the kernel without holding
+    the interpreter lock, and passing each ready batch to
+    Queue.processEvents in the reactor thread.
+
+    Used instead of KAIOFd.
+    """
+
+    pollNSec = 100000000 # how often to check for stop()
+
+    def __init__(self, queue):
+        threading.Thread.__init__(self, name = "KAIOReaper-%i" % queue.fd)
+        self.setDaemon(True)
+        self.queue = queue
+        self.running = True
+
+    def run(self):
+        while self.running:
+            # also true for operations a flush failed to submit
+            if self.queue.reapEvents(minEvents = 1, maxEvents = self.queue.maxIO, timeoutNSec = self.pollNSec):
+                reactor.callFromThread(self.queue.processEvents, maxEvents = self.queue.maxIO)
+
+    def stop(self):
+        self.running = False
+        self.join()
+
 class KAIOCooperator(object):
     """This is an object, which cooperates with aio.Queue.    
-    """
 
-    whenQueueFullDelay = 0.01
+    When the queue is full, it waits for Queue.waitForSlots, so it is
+    resumed by processEvents as soon as slots are available.
+    """
 
     def __init__(self, queue, chunks):
         self.queue = queue
@@ -48,7 +85,7 @@ class KAIOCooperator(object):
     def start(self):
         return self.queueMe()
 
-    def completed(self):
+    def finished(self):
         raise Exception(NotImplemented)
 
     def allowedToQueue(self, noSlots):
@@ -61,27 +98,36 @@ class KAIOCooperator(object):
         print "ERROR"
         print str(args[0])
         sys.exit(-1)
+
+    def _collected(self, data, noSlots):
+        self.completed += noSlots
+        self.chunkCollected(data)
+        return self.queueMe()
     
     def queueMe(self):
         chunksLeft = self.chunks - self.completed
         if chunksLeft < 1:
-            return self.completed()
+            return self.finished()
         availableSlots = self.queue.maxIO - self.queue.busy
         if availableSlots < 1:
-            return reactor.callLater(self.whenQueueFullDelay, self.queueMe)
+            return self.queue.waitForSlots().addCallback(lambda _: self.queueMe())
         thisTurn = chunksLeft
         if thisTurn > availableSlots:
             thisTurn = availableSlots  # XXX: shouldn't we take a parametrized slice of queue instead of just whole queue here?
         d = self.allowedToQueue(noSlots = thisTurn)
-        d.addCallbacks(self.chunkCollected).addCallback(lambda x, y: reactor.callLater, self.queueMe)
+        d.addCallback(self._collected, thisTurn)
         d.addErrback(self.error)
         return d
         
 class DeferredFile(KAIOCooperator):
     """This is DeferredFile, a file which is read in asynchronous way via KAIO.
+
+    If scheduler (a ReadScheduler or a BlockCache) is given, chunks are
+    read through it instead of being scheduled on the queue directly.
     """
-    def __init__(self, queue, filename, chunkSize = 4096, callback = None):
+    def __init__(self, queue, filename, chunkSize = 4096, callback = None, scheduler = None):
         self.filename = filename
+        self.scheduler = scheduler
         self.fd = os.open(filename, os.O_RDONLY | os.O_DIRECT)
         self.fileSize = os.stat(filename).st_size
         self.chunkSize = chunkSize
@@ -92,24 +138,1038 @@ class DeferredFile(KAIOCooperator):
         self.defer = defer.Deferred()
 
     def allowedToQueue(self, noSlots):
+        if self.scheduler is not None:
+            reads = [self.scheduler.read(self.fd, (self.completed + a) * self.chunkSize, self.chunkSize) for a in range(noSlots)]
+            return defer.gatherResults(reads)
         return self.queue.scheduleRead(self.fd, self.completed * self.chunkSize, noSlots, self.chunkSize)
 
     def chunkCollected(self, data):
         # data chunks are now ignored
         pass
 
-    def completed(self):
-        return self.defer.callback()
+    def finished(self):
+        if self.scheduler is not None:
+            self.scheduler.release(self.fd)
+        return self.defer.callback(None)
+
+class FileProducer(object):
+    """
+    Streams a file (or length bytes of it, starting at offset) to a
+    consumer, in order, as an IPushProducer.
+
+    At most window chunks are read or waiting for the consumer at a
+    time, so memory stays at window * chunkSize however large the file
+    is. Chunks completing out of order are held until the ones before
+    them were written. While paused, no new reads are scheduled.
+    """
+    implements(interfaces.IPushProducer)
+
+    def __init__(self, queue, filename, chunkSize = 4096, window = 16, offset = 0, length = None):
+        self.queue = queue
+        self.fd = os.open(filename, os.O_RDONLY | os.O_DIRECT)
+        if length is None:
+            length = os.fstat(self.fd).st_size - offset
+        self.chunkSize = chunkSize
+        self.window = window
+        self.offset = offset
+        self.length = length
+        self.chunks = length / chunkSize
+        if length % chunkSize:
+            self.chunks += 1
+        self.issued = 0
+        self.delivered = 0
+        self.ready = {}
+        self.reading = {} # index -> callback of the reads in flight
+        self.waiting = None
+        self.paused = False
+        self.consumer = None
+        self.defer = defer.Deferred()
+
+    def beginProducing(self, consumer):
+        self.consumer = consumer
+        consumer.registerProducer(self, True)
+        self._deliver()
+        return self.defer
+
+    def pauseProducing(self):
+        self.paused = True
+
+    def resumeProducing(self):
+        self.paused = False
+        self._deliver()
+
+    def stopProducing(self):
+        self._finish(failure.Failure(Exception("Consumer asked us to stop producing")))
+
+    def _fill(self):
+        while (not self.paused and self.waiting is None and self.consumer is not None and
+               self.issued < self.chunks and self.issued - self.delivered < self.window):
+            index = self.issued
+            self.reading[index] = callback = lambda data, index = index: self._arrived(index, data)
+            try:
+                self._read(index, callback)
+            except QueueError:
+                del self.reading[index]
+                self.waiting = self.queue.waitForSlots()
+                self.waiting.addCallback(self._slotsFreed)
+                return
+            except IOError, e:
+                del self.reading[index]
+                return self._finish(failure.Failure(e))
+            self.issued += 1
+
+    def _read(self, index, callback):
+        self.queue.scheduleRead(self.fd, self.offset + index * self.chunkSize, 1, self._chunkLength(index),
+                                callback = callback)
+
+    def _write(self, index, data):
+        self.consumer.write(data)
+
+    def _chunkLength(self, index):
+        return min(self.chunkSize, self.length - index * self.chunkSize)
+
+    def _slotsFreed(self, _):
+        self.waiting = None
+        self._fill()
+
+    def _arrived(self, index, data):
+        self.reading.pop(index, None)
+        if self.consumer is None:
+            return
+        if isinstance(data, Exception):
+            return self._finish(failure.Failure(data))
+        self.ready[index] = data
+        self._deliver()
+
+    def _deliver(self):
+        while not self.paused and self.delivered in self.ready:
+            # write() may pause us, or stop us
+            self._write(self.delivered, self.ready.pop(self.delivered))
+            self.delivered += 1
+            if self.consumer is None:
+                return
+        if self.delivered == self.chunks:
+            return self._finish(None)
+        self._fill()
+
+    def _finish(self, result):
+        if self.consumer is None:
+            return
+        self.consumer.unregisterProducer()
+        self.consumer = None
+        self.ready.clear()
+        # nobody wants the rest, free the slots for live requests
+        for callback in self.reading.values():
+            self.queue.cancel(callback)
+        self.reading.clear()
+        if self.waiting is not None:
+            self.queue.cancel(self.waiting)
+            self.waiting = None
+        os.close(self.fd)
+        if result is None:
+            self.defer.callback(None)
+        else:
+            self.defer.errback(result)
+
+class SendFileProducer(FileProducer):
+    """
+    FileProducer for socket transports, which sends the file without
+    turning it into Python strings.
+
+    Chunks are read into a Staging area, window chunks long, and
+    passed to the socket with sendfile() as long as the transport has
+    nothing buffered. Whatever the socket does not take right away
+    is copied out and written to the transport the usual way, so the
+    transport still handles flow control. TLS transports, consumers
+    without a socket and transports whose buffer can not be checked
+    always get copies.
+
+    Every chunk gets whole pages of the staging area, so that the
+    pages sent can be discarded before the next read reuses them.
+    """
+
+    def __init__(self, queue, filename, chunkSize = 65536, window = 8, offset = 0, length = None):
+        FileProducer.__init__(self, queue, filename, chunkSize, window, offset, length)
+        self.stride = (chunkSize + mmap.PAGESIZE - 1) / mmap.PAGESIZE * mmap.PAGESIZE
+        self.staging = Staging(window * self.stride)
+        self.sent = 0 # bytes which went through sendfile()
+
+    def beginProducing(self, consumer):
+        self.direct = hasattr(consumer, "fileno") and not interfaces.ISSLTransport.providedBy(consumer)
+        return FileProducer.beginProducing(self, consumer)
+
+    def _read(self, index, callback):
+        self.queue.scheduleReadInto(self.fd, self.offset + index * self.chunkSize, self.staging,
+                                    (index % self.window) * self.stride, self.chunkSize,
+                                    callback = callback)
+
+    def _drained(self):
+        """
+        Whether the transport provably wrote everything it was given,
+        so that sendfile() can not overtake any of it. Twisted has no
+        public way to ask; this reads the write buffer of
+        twisted.internet.abstract.FileDescriptor and answers False for
+        any other transport, or one laid out differently.
+        """
+        consumer = self.consumer
+        if not isinstance(consumer, abstract.FileDescriptor):
+            return False
+        try:
+            return len(consumer.dataBuffer) - consumer.offset + consumer._tempDataLen == 0
+        except (AttributeError, TypeError):
+            return False
+
+    def _write(self, index, data):
+        start = (index % self.window) * self.stride
+        # data is the number of bytes read, fewer at the end of file;
+        # the rest of the slot still holds an earlier chunk
+        size = min(data, self._chunkLength(index))
+        sent = 0
+        if self.direct and self._drained():
+            try:
+                while sent < size:
+                    n = sendfile(self.consumer.fileno(), self.staging.fd, start + sent, size - sent)
+                    if not n:
+                        break
+                    sent += n
+            except IOError, e:
+                return self._finish(failure.Failure(e))
+            self.sent += sent
+        if sent < size:
+            self.consumer.write(str(buffer(self.staging, start + sent, size - sent)))
+        if sent:
+            # the socket may still reference these pages
+            self.staging.discard(start, self.stride)
+
+class FileCopier(object):
+    """
+    Deferred replacement for shutil.copyfileobj, copying file src to
+    dst with O_DIRECT.
+
+    Up to depth chunks are being read or written at a time. Every
+    chunk is read into a pooled buffer and written from that very
+    buffer, so the data is never copied in memory. Chunks are the
+    queue's bufferSize unless given; larger ones do not fit the pool
+    and get buffers of their own. The tail of a file
+    which is not a multiple of chunkSize is written padded and cut
+    off afterwards.
+
+    self.defer fires with a dict of statistics: bytes, seconds and
+    throughput (bytes per second).
+    """
+
+    def __init__(self, queue, src, dst, chunkSize = None, depth = 4):
+        self.queue = queue
+        # a queue without a pool (bufferSize 0) gets 1 MiB chunks
+        self.chunkSize = chunkSize = chunkSize or queue.bufferSize or 1 << 20
+        self.depth = depth
+        self.srcFd = os.open(src, os.O_RDONLY | os.O_DIRECT)
+        st = os.fstat(self.srcFd)
+        self.dstFd = os.open(dst, os.O_WRONLY | os.O_CREAT | os.O_TRUNC | os.O_DIRECT, st.st_mode & 07777)
+        self.size = st.st_size
+        self.chunks = self.size / chunkSize
+        if self.size % chunkSize:
+            self.chunks += 1
+        self.issued = 0
+        self.inflight = 0
+        self.copied = 0
+        self.retry = [] # operations refused because the queue was full
+        self.waiting = False
+        self.error = None
+        self.defer = defer.Deferred()
+
+    def start(self):
+        self.started = time.time()
+        if not self.chunks:
+            # nothing to read, so nothing would ever call _done
+            os.close(self.srcFd)
+            os.close(self.dstFd)
+            self.defer.callback({"bytes": 0, "seconds": 0.0, "throughput": 0})
+            return self.defer
+        self._fill()
+        return self.defer
+
+    def _fill(self):
+        while self.error is None and self.issued < self.chunks and self.inflight < self.depth:
+            self.retry.append(lambda index = self.issued: self._read(index))
+            self.issued += 1
+            self.inflight += 1
+        self._flush()
+
+    def _flush(self):
+        while self.retry and not self.waiting:
+            operation = self.retry.pop(0)
+            try:
+                operation()
+            except QueueError:
+                self.retry.insert(0, operation)
+                self.waiting = True
+                self.queue.waitForSlots().addCallback(self._slotsFreed)
+            except IOError, e:
+                self._failed(e)
+
+    def _slotsFreed(self, _):
+        self.waiting = False
+        self._flush()
+
+    def _read(self, index):
+        self.queue.scheduleRead(self.srcFd, index * self.chunkSize, 1, self.chunkSize, zeroCopy = 1,
+                                callback = lambda data: self._readDone(index, data))
+
+    def _readDone(self, index, data):
+        if isinstance(data, Exception):
+            return self._failed(data)
+        if self.error is not None:
+            return self._done()
+        if index == self.chunks - 1 and len(data) % mmap.PAGESIZE:
+            # the tail; cut off again in _done
+            data = str(data) + "\0" * (mmap.PAGESIZE - len(data) % mmap.PAGESIZE)
+        self.retry.append(lambda: self.queue.scheduleWrite(self.dstFd, index * self.chunkSize, data,
+                                                           callback = self._writeDone))
+        self._flush()
+
+    def _writeDone(self, res):
+        if isinstance(res, Exception):
+            return self._failed(res)
+        self.copied += res
+        self._done()
+
+    def _failed(self, e):
+        if self.error is None:
+            self.error = e
+        self._done()
+
+    def _done(self):
+        self.inflight -= 1
+        if self.inflight or (self.error is None and self.issued < self.chunks):
+            return self._fill()
+        if self.error is None and self.size % mmap.PAGESIZE:
+            os.ftruncate(self.dstFd, self.size)
+        os.close(self.srcFd)
+        os.close(self.dstFd)
+        if self.error is not None:
+            return self.defer.errback(failure.Failure(self.error))
+        seconds = time.time() - self.started
+        self.defer.callback({"bytes": self.size, "seconds": seconds,
+                             "throughput": seconds and self.size / seconds})
+
+def _withTimeout(name):
+    schedule = getattr(_aio_Queue, name)
+    def method(self, *args, **kw):
+        timeout = kw.pop("timeout", self.timeout)
+        d = schedule(self, *args, **kw)
+        if timeout and d is not None:
+            self.setDeadline(d, timeout)
+        return d
+    method.__name__ = name
+    method.__doc__ = schedule.__doc__ + """
+With timeout (in seconds, Queue.timeout by default), the returned
+Deferred is errback'ed with twisted.internet.defer.TimeoutError and
+its operations cancelled if they did not complete in time.
+"""
+    return method
 
 class Queue(_aio_Queue):
+    """
+    _aio.Queue hooked up to the reactor. With threaded = True,
+    completions are reaped by a KAIOReaper thread instead of
+    being read in the reactor thread.
+
+    With flushThreshold set, operations scheduled during one reactor
+    iteration are submitted together at its end.
+
+    With timeout set, operations returning a Deferred which did not
+    complete within timeout seconds are cancelled, see setDeadline.
+
+    completionHandler is called with the completions of operations
+    scheduled with a token, see _aio.Queue.scheduleRead.
+    """
+    sweepInterval = 0.5 # seconds between checks for expired deadlines
+
     def __init__(self, *args, **kw):
+        completionHandler = kw.pop("completionHandler", None)
+        threaded = kw.pop("threaded", False)
+        self.timeout = kw.pop("timeout", 0)
         _aio_Queue.__init__(self, *args, **kw)
-        self.reader = KAIOFd(self.fd, self)
-        reactor.addReader(self.reader)
+        self.completionHandler = completionHandler
+        self.flushHook = self._scheduleFlush
+        self._flushCall = None
+        self._deadlines = [] # heap of [when, Deferred or None]
+        self._sweepCall = None
+        if threaded:
+            self.reader = KAIOReaper(self)
+            self.reader.start()
+        else:
+            self.reader = KAIOFd(self.fd, self)
+            reactor.addReader(self.reader)
+
+    def _scheduleFlush(self):
+        if self._flushCall is None or not self._flushCall.active():
+            self._flushCall = reactor.callLater(0, self.flush)
+
+    def _getAverageBatchSize(self):
+        if not self.submitCalls:
+            return 0.0
+        return float(self.submitted) / self.submitCalls
+    averageBatchSize = property(_getAverageBatchSize)
+
+    scheduleRead = _withTimeout("scheduleRead")
+    scheduleReadInto = _withTimeout("scheduleReadInto")
+    scheduleWrite = _withTimeout("scheduleWrite")
+    scheduleReadv = _withTimeout("scheduleReadv")
+    scheduleWritev = _withTimeout("scheduleWritev")
+    scheduleFsync = _withTimeout("scheduleFsync")
+    scheduleBarrier = _withTimeout("scheduleBarrier")
+
+    def setDeadline(self, d, timeout):
+        """
+        Cancel the operations of Deferred d (or of each Deferred of a
+        DeferredList) and errback it with defer.TimeoutError, unless it
+        fired within timeout seconds. Deadlines are checked every
+        sweepInterval seconds, so they may be missed by that much.
+        """
+        for member in getattr(d, "_deferredList", [d]):
+            entry = [time.time() + timeout, member]
+            heapq.heappush(self._deadlines, entry)
+            member.addBoth(self._clearDeadline, entry)
+        if self._sweepCall is None and self._deadlines:
+            self._sweepCall = reactor.callLater(self.sweepInterval, self._sweep)
+
+    def _clearDeadline(self, result, entry):
+        entry[1] = None
+        return result
+
+    def _sweep(self):
+        self._sweepCall = None
+        now = time.time()
+        while self._deadlines and self._deadlines[0][0] <= now:
+            when, d = heapq.heappop(self._deadlines)
+            if d is not None:
+                self.cancel(d, defer.TimeoutError("operation did not complete in time"))
+        if self._deadlines:
+            self._sweepCall = reactor.callLater(self.sweepInterval, self._sweep)
 
-    def readfile(self, filename, chunkSize = 4096, callback=None):
-        f = DeferredFile(self, filename, chunkSize, callback)
+    def stop(self):
+        if self._sweepCall is not None:
+            self._sweepCall.cancel()
+            self._sweepCall = None
+        if isinstance(self.reader, KAIOReaper):
+            self.reader.stop()
+        else:
+            reactor.removeReader(self.reader)
+
+    def copyFile(self, src, dst, chunkSize = None, depth = 4):
+        return FileCopier(self, src, dst, chunkSize, depth).start()
+
+    def sendFile(self, transport, filename, offset = 0, length = None, chunkSize = 65536, window = 8):
+        p = SendFileProducer(self, filename, chunkSize, window, offset, length)
+        return p.beginProducing(transport)
+
+    def readfile(self, filename, chunkSize = 4096, callback=None, scheduler=None):
+        f = DeferredFile(self, filename, chunkSize, callback, scheduler)
         f.start()
         return f.defer
-        
-        
+
+class QueuePool(object):
+    """
+    Several Queues, each with its own context and eventfd, so that
+    completions are not funneled through a single io_getevents call
+    and a single reader. Operations are spread across the queues by
+    file descriptor; all operations on one file go to the same queue.
+
+    By default there is one queue per CPU. Keyword arguments are
+    passed to every Queue, so QueuePool(threaded = True) reaps each
+    queue in its own thread.
+    """
+    def __init__(self, queues = None, **kw):
+        if queues is None:
+            queues = os.sysconf("SC_NPROCESSORS_ONLN")
+        self.queues = [Queue(**kw) for a in range(queues)]
+
+    def queueFor(self, fd):
+        return self.queues[fd % len(self.queues)]
+
+    def scheduleRead(self, fd, *args, **kw):
+        return self.queueFor(fd).scheduleRead(fd, *args, **kw)
+
+    def scheduleWrite(self, fd, *args, **kw):
+        return self.queueFor(fd).scheduleWrite(fd, *args, **kw)
+
+    def scheduleReadv(self, fd, *args, **kw):
+        return self.queueFor(fd).scheduleReadv(fd, *args, **kw)
+
+    def scheduleWritev(self, fd, *args, **kw):
+        return self.queueFor(fd).scheduleWritev(fd, *args, **kw)
+
+    def scheduleFsync(self, fd, *args, **kw):
+        return self.queueFor(fd).scheduleFsync(fd, *args, **kw)
+
+    def scheduleBarrier(self, fd, *args, **kw):
+        return self.queueFor(fd).scheduleBarrier(fd, *args, **kw)
+
+    def waitForSlots(self, fd, slots = 1):
+        return self.queueFor(fd).waitForSlots(slots)
+
+    def cancel(self, d, error = None):
+        return sum([q.cancel(d, error) for q in self.queues])
+
+    maxIO = property(lambda self: sum([q.maxIO for q in self.queues]))
+    busy = property(lambda self: sum([q.busy for q in self.queues]))
+
+    def stop(self):
+        for q in self.queues:
+            q.stop()
+
+def _elastic(name):
+    def method(self, *args, **kw):
+        return self._schedule(name, args, kw)
+    method.__name__ = name
+    method.__doc__ = getattr(Queue, name).__doc__
+    return method
+
+class ElasticQueue(object):
+    """
+    Queues of maxIO slots each, which never refuse an operation: what
+    does not fit waits in a backlog, in order, and is submitted as
+    slots free up. If the backlog lasts growAfter seconds, another
+    Queue - with its own context - is added, up to maxQueues. Added
+    queues which were idle for idleAfter seconds are retired again.
+
+    Keyword arguments are passed to every Queue. Operations with a
+    callback or token return None also when they are backlogged.
+    """
+    checkInterval = 0.1 # seconds between growth and idle checks
+
+    def __init__(self, maxIO = 64, maxQueues = 8, growAfter = 0.05, idleAfter = 5.0, **kw):
+        self.queueMaxIO = maxIO
+        self.maxQueues = maxQueues
+        self.growAfter = growAfter
+        self.idleAfter = idleAfter
+        self.kw = kw
+        self.queues = []
+        self.lastUsed = {}  # queue -> time of its last submission
+        self.waiting = {}   # queue -> waitForSlots Deferred
+        self.backlog = collections.deque() # (name, args, kw, deferred, [submitted deferred])
+        self.backlogSince = None
+        self.grown = 0      # queues added to the first one
+        self.retired = 0
+        self._checkCall = None
+        self._grow()
+
+    scheduleRead = _elastic("scheduleRead")
+    scheduleReadInto = _elastic("scheduleReadInto")
+    scheduleWrite = _elastic("scheduleWrite")
+    scheduleReadv = _elastic("scheduleReadv")
+    scheduleWritev = _elastic("scheduleWritev")
+    scheduleFsync = _elastic("scheduleFsync")
+    scheduleBarrier = _elastic("scheduleBarrier")
+
+    maxIO = property(lambda self: sum([q.maxIO for q in self.queues]))
+    busy = property(lambda self: sum([q.busy for q in self.queues]))
+
+    def cancel(self, d, error = None):
+        for entry in self.backlog:
+            if entry[3] is d or d in (entry[2].get("callback"), entry[2].get("token")):
+                self.backlog.remove(entry)
+                if error is not None and entry[3] is not None:
+                    d.errback(failure.Failure(error))
+                return 1
+        return sum([q.cancel(d, error) for q in self.queues])
+
+    def stop(self):
+        if self._checkCall is not None and self._checkCall.active():
+            self._checkCall.cancel()
+        for q in self.queues:
+            q.stop()
+
+    def _schedule(self, name, args, kw):
+        if not self.backlog:
+            # the one with the most free slots
+            q = max(self.queues, key = lambda q: q.maxIO - q.busy)
+            try:
+                d = getattr(q, name)(*args, **kw)
+            except QueueError:
+                if not q.busy:
+                    raise # more than maxIO slots, it would never fit
+            else:
+                self.lastUsed[q] = time.time()
+                return d
+            self.backlogSince = time.time()
+        d, submitted = None, []
+        if "callback" not in kw and "token" not in kw:
+            d = defer.Deferred(lambda d: self._cancelled(d, submitted))
+        self.backlog.append((name, args, kw, d, submitted))
+        self._pressure()
+        if self.backlog:
+            self._wait()
+        self._check()
+        return d
+
+    def _cancelled(self, d, submitted):
+        # once submitted, what the queue returned is cancelled instead
+        if submitted:
+            submitted[0].cancel()
+        else:
+            self.cancel(d)
+
+    def _drain(self):
+        while self.backlog:
+            name, args, kw, d, submitted = self.backlog[0]
+            for q in sorted(self.queues, key = lambda q: q.busy - q.maxIO):
+                try:
+                    result = getattr(q, name)(*args, **kw)
+                except QueueError, e:
+                    if q.busy:
+                        continue
+                    result = e
+                except IOError, e:
+                    result = e
+                self.backlog.popleft()
+                self.lastUsed[q] = time.time()
+                if isinstance(result, Exception):
+                    if d is not None:
+                        d.errback(failure.Failure(result))
+                    elif "callback" in kw:
+                        kw["callback"](result)
+                elif d is not None:
+                    submitted.append(result)
+                    result.chainDeferred(d)
+                break
+            else:
+                return self._wait()
+        self.backlogSince = None
+
+    def _wait(self):
+        # woken up by whichever queue completes something first
+        for q in self.queues:
+            if q not in self.waiting:
+                self.waiting[q] = q.waitForSlots(min(q.maxIO - q.busy + 1, q.maxIO))
+                self.waiting[q].addCallback(self._slotsFreed, q)
+
+    def _slotsFreed(self, _, q):
+        del self.waiting[q]
+        self._drain()
+
+    def _grow(self):
+        q = Queue(self.queueMaxIO, **self.kw)
+        self.queues.append(q)
+        self.lastUsed[q] = time.time()
+
+    def _retire(self, q):
+        self.queues.remove(q)
+        del self.lastUsed[q]
+        if q in self.waiting:
+            q.cancel(self.waiting.pop(q))
+        q.stop()
+        # give the context back now, not whenever q is collected
+        q.close()
+        self.retired += 1
+
+    def _check(self):
+        if self._checkCall is None or not self._checkCall.active():
+            self._checkCall = reactor.callLater(self.checkInterval, self._periodic)
+
+    def _pressure(self):
+        # add a context if the backlog lasted growAfter seconds
+        if (self.backlog and time.time() - self.backlogSince >= self.growAfter and
+            len(self.queues) < self.maxQueues):
+            self._grow()
+            self.grown += 1
+            self.backlogSince = time.time()
+            self._drain()
+
+    def _periodic(self):
+        self._pressure()
+        now = time.time()
+        for q in self.queues[1:]:
+            if not self.backlog and not q.busy and now - self.lastUsed[q] >= self.idleAfter:
+                self._retire(q)
+        if self.backlog or len(self.queues) > 1:
+            self._check()
+
+class ReadScheduler(object):
+    """
+    Scheduling layer for reads above a Queue.
+
+    Reads requested during one reactor iteration are sorted by file
+    and offset, neighbouring and overlapping ones are merged into
+    aligned requests of up to maxRequest bytes, and every requester
+    gets its own slice of the result. A read falling into a request
+    already in flight waits for it instead.
+
+    Files read sequentially get readahead: the window starts at
+    minReadahead, doubles with every sequential batch up to
+    maxReadahead, and is dropped by a seek. Data read ahead is kept,
+    one window per file for the maxFiles files read last, and serves
+    later reads directly. Writes made behind the scheduler's back are
+    not seen there.
+
+    State is kept by descriptor number: call release() before closing
+    one, or a file opened later under the same number gets its data.
+    """
+
+    def __init__(self, queue, maxRequest = 1 << 20, minReadahead = 64 << 10,
+                 maxReadahead = 1 << 20, alignment = 4096, maxFiles = 64):
+        self.queue = queue
+        self.maxRequest = maxRequest
+        self.minReadahead = minReadahead
+        self.maxReadahead = maxReadahead
+        self.alignment = alignment
+        self.maxFiles = maxFiles
+        self.pending = {}   # fd -> [(offset, size, deferred)]
+        self.inflight = {}  # fd -> [[start, end, requests, readahead]]
+        self.readahead = collections.OrderedDict() # fd -> (offset, data), oldest first
+        self.streams = collections.OrderedDict()   # fd -> [next offset, readahead window]
+        self.flushCall = None
+        self.requests = 0
+        self.submitted = 0
+        self.readaheadHits = 0
+
+    def read(self, fd, offset, size):
+        self.requests += 1
+        cached = self.readahead.get(fd)
+        if cached and cached[0] <= offset and offset + size <= cached[0] + len(cached[1]):
+            self.readaheadHits += 1
+            self._consumed(fd, offset + size, cached[0] + len(cached[1]))
+            start = offset - cached[0]
+            return defer.succeed(cached[1][start:start + size])
+        d = defer.Deferred()
+        for extent in self.inflight.get(fd, ()):
+            if extent[0] <= offset and offset + size <= extent[1]:
+                extent[2].append((offset, size, d))
+                return d
+        self.pending.setdefault(fd, []).append((offset, size, d))
+        if self.flushCall is None:
+            self.flushCall = reactor.callLater(0, self.flush)
+        return d
+
+    def release(self, fd):
+        """
+        Forget everything known about fd, before it is closed. Reads
+        still in flight complete, but their data is not kept.
+        """
+        self.readahead.pop(fd, None)
+        self.streams.pop(fd, None)
+        for extent in self.inflight.pop(fd, ()):
+            extent[3] = False
+
+    def flush(self):
+        self.flushCall = None
+        pending, self.pending = self.pending, {}
+        for fd, requests in pending.items():
+            requests.sort()
+            extents = []
+            for offset, size, d in requests:
+                start = offset - offset % self.alignment
+                end = offset + size
+                end += -end % self.alignment
+                if extents and start <= extents[-1][1] and max(end, extents[-1][1]) - extents[-1][0] <= self.maxRequest:
+                    extents[-1][1] = max(end, extents[-1][1])
+                    extents[-1][2].append((offset, size, d))
+                else:
+                    extents.append([start, end, [(offset, size, d)], False])
+            window = self._window(fd, requests[0][0], requests[-1][0] + requests[-1][1])
+            if window:
+                self._prefetch(fd, extents[-1][1], window, extents)
+            for extent in extents:
+                self._submit(fd, extent)
+
+    def _window(self, fd, first, end):
+        state = self.streams.get(fd)
+        if state is not None and state[0] == first:
+            window = min(max(state[1] * 2, self.minReadahead), self.maxReadahead)
+        else:
+            window = 0
+        self._remember(self.streams, fd, [end, window])
+        return window
+
+    def _consumed(self, fd, end, cachedEnd):
+        # keep reading ahead once half of the window was used
+        state = self.streams.get(fd)
+        if state is None:
+            state = self._remember(self.streams, fd, [end, 0])
+        state[0] = end
+        for extent in self.inflight.get(fd, ()):
+            if extent[0] <= cachedEnd < extent[1]:
+                return
+        cached = self.readahead[fd]
+        if end > cached[0] + len(cached[1]) / 2:
+            state[1] = min(max(state[1] * 2, self.minReadahead), self.maxReadahead)
+            self._prefetch(fd, cachedEnd, state[1])
+
+    def _prefetch(self, fd, start, window, extents = None):
+        size = os.fstat(fd).st_size
+        end = min(start + window, size - size % self.alignment)
+        if end <= start:
+            return
+        if extents and extents[-1][1] == start and end - extents[-1][0] <= self.maxRequest:
+            extents[-1][1] = end
+            extents[-1][3] = True
+        elif extents is not None:
+            extents.append([start, end, [], True])
+        else:
+            self._submit(fd, [start, end, [], True])
+
+    def _submit(self, fd, extent):
+        self.inflight.setdefault(fd, []).append(extent)
+        self.submitted += 1
+        self._issue(fd, extent)
+
+    def _issue(self, fd, extent):
+        try:
+            self.queue.scheduleRead(fd, extent[0], 1, extent[1] - extent[0],
+                                    callback = lambda data: self._done(fd, extent, data))
+        except QueueError:
+            self.queue.waitForSlots().addCallback(lambda _: self._issue(fd, extent))
+        except IOError, e:
+            self._done(fd, extent, e)
+
+    def _remember(self, states, fd, state):
+        states.pop(fd, None)
+        states[fd] = state
+        if len(states) > self.maxFiles:
+            states.popitem(last = False)
+        return state
+
+    def _done(self, fd, extent, data):
+        extents = self.inflight.get(fd, [])
+        # released extents are not listed any more
+        if extent in extents:
+            extents.remove(extent)
+            if not extents:
+                del self.inflight[fd]
+        if isinstance(data, Exception):
+            for offset, size, d in extent[2]:
+                d.errback(failure.Failure(data))
+            return
+        if extent[3]:
+            self._remember(self.readahead, fd, (extent[0], data))
+        for offset, size, d in extent[2]:
+            start = offset - extent[0]
+            d.callback(data[start:start + size])
+
+class BlockCache(object):
+    """
+    Cache of file blocks shared by everyone reading through it.
+
+    Blocks are blockSize bytes long and keyed by (device, inode, block
+    number), so different descriptors of one file share them. They are
+    copied out of the queue's buffers, which stay free for other reads,
+    kept up to budget bytes, and evicted with the CLOCK algorithm.
+    Concurrent misses on one block wait for a single read.
+
+    Writes made behind the cache's back are not seen; use clear(). The
+    inode of a descriptor is looked up once; call release() before
+    closing it.
+    """
+
+    def __init__(self, queue, budget = 64 << 20, blockSize = 64 << 10):
+        self.queue = queue
+        self.blockSize = blockSize
+        self.capacity = max(budget // blockSize, 1)
+        self.entries = {}   # key -> [clock slot, data]
+        self.files = {}     # fd -> (device, inode)
+        self.inflight = {}  # key -> [deferred]
+        self.clock = []     # [key, referenced]
+        self.hand = 0
+        self.hits = 0
+        self.misses = 0
+        self.coalesced = 0
+        self.evictions = 0
+
+    def read(self, fd, offset, size):
+        inode = self.files.get(fd)
+        if inode is None:
+            st = os.fstat(fd)
+            inode = self.files[fd] = (st.st_dev, st.st_ino)
+        first = offset // self.blockSize
+        last = (offset + size - 1) // self.blockSize
+        start = offset - first * self.blockSize
+        blocks = [self._block(fd, inode + (n,)) for n in range(first, last + 1)]
+        if len(blocks) == 1:
+            return blocks[0].addCallback(lambda block: block[start:start + size])
+        return defer.gatherResults(blocks).addCallback(lambda blocks: "".join(blocks)[start:start + size])
+
+    def clear(self):
+        self.entries.clear()
+        del self.clock[:]
+        self.hand = 0
+
+    def release(self, fd):
+        """
+        Forget the inode of fd, before it is closed. Its blocks stay
+        cached for other descriptors of the file.
+        """
+        self.files.pop(fd, None)
+
+    def _block(self, fd, key):
+        entry = self.entries.get(key)
+        if entry is not None:
+            self.hits += 1
+            self.clock[entry[0]][1] = True
+            return defer.succeed(entry[1])
+        d = defer.Deferred()
+        if key in self.inflight:
+            self.coalesced += 1
+            self.inflight[key].append(d)
+            return d
+        self.misses += 1
+        self.inflight[key] = [d]
+        self._fetch(fd, key)
+        return d
+
+    def _fetch(self, fd, key):
+        try:
+            self.queue.scheduleRead(fd, key[2] * self.blockSize, 1, self.blockSize,
+                                    callback = lambda data: self._filled(key, data))
+        except QueueError:
+            self.queue.waitForSlots().addCallback(lambda _: self._fetch(fd, key))
+        except IOError, e:
+            self._filled(key, e)
+
+    def _filled(self, key, data):
+        waiters = self.inflight.pop(key)
+        if isinstance(data, Exception):
+            for d in waiters:
+                d.errback(failure.Failure(data))
+            return
+        self._insert(key, data)
+        for d in waiters:
+            d.callback(data)
+
+    def _insert(self, key, block):
+        if len(self.clock) < self.capacity:
+            self.entries[key] = [len(self.clock), block]
+            self.clock.append([key, False])
+            return
+        # second chance for referenced blocks, evict the first one that is not
+        while self.clock[self.hand][1]:
+            self.clock[self.hand][1] = False
+            self.hand = (self.hand + 1) % self.capacity
+        del self.entries[self.clock[self.hand][0]]
+        self.evictions += 1
+        self.entries[key] = [self.hand, block]
+        self.clock[self.hand] = [key, False]
+        self.hand = (self.hand + 1) % self.capacity
+
+IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE = 1, 2, 3
+
+def ioprio(ioclass, level = 4):
+    """
+    Kernel I/O priority for Queue.ioprio or PriorityScheduler.addClass:
+    level 0 is the highest, 7 the lowest. See man:ioprio_set(2) .
+    """
+    return ioclass << 13 | level
+
+class _IOClass(object):
+    """
+    One class of a PriorityScheduler.
+    """
+
+    def __init__(self, weight, ioprio):
+        self.weight = weight
+        self.ioprio = ioprio
+        self.pending = collections.deque() # (tag, cost, call, deferred), in order
+        self.tag = 0.0 # finish tag of the last operation requested
+        self.bytes = 0 # submitted so far
+
+class PriorityScheduler(object):
+    """
+    Weighted fair queuing of reads and writes above a Queue.
+
+    Operations belong to classes - kinds of work, or tenants - added
+    with addClass. While more is requested than depth operations in
+    flight, every class gets a share of the bytes proportional to its
+    weight: with weights 8 and 1, latency-sensitive reads go first,
+    but a bulk scan still moves one byte for every eight of theirs.
+    Each class may also have a kernel I/O priority, passed down with
+    the operations it submits, so the disk scheduler sees it too.
+
+    The operations of one class are submitted in the order requested.
+    Cancelling the Deferred of an operation drops it, or cancels it on
+    the queue once submitted.
+    """
+
+    def __init__(self, queue, depth = None):
+        self.queue = queue
+        self.depth = depth or queue.maxIO
+        self.classes = {}   # name -> _IOClass
+        self.submitted = {} # deferred -> callback given to the queue
+        self.inflight = 0
+        self.vtime = 0.0    # tag of the last operation submitted
+        self.waiting = False
+
+    def addClass(self, name, weight = 1, ioprio = 0):
+        self.classes[name] = _IOClass(weight, ioprio)
+
+    def read(self, name, fd, offset, size):
+        return self._request(name, size, (self.queue.scheduleRead, fd, offset, 1, size))
+
+    def write(self, name, fd, offset, data):
+        return self._request(name, len(data), (self.queue.scheduleWrite, fd, offset, data))
+
+    def _request(self, name, cost, call):
+        cls = self.classes[name]
+        # a class which was idle gets no credit for it
+        cls.tag = max(cls.tag, self.vtime) + float(cost) / cls.weight
+        d = defer.Deferred(lambda d: self._cancelled(cls, d))
+        cls.pending.append((cls.tag, cost, call, d))
+        self._dispatch()
+        return d
+
+    def _cancelled(self, cls, d):
+        callback = self.submitted.pop(d, None)
+        if callback is None:
+            for entry in cls.pending:
+                if entry[3] is d:
+                    cls.pending.remove(entry)
+                    return
+            return
+        # nothing is called for it any more, its depth is free now
+        self.queue.cancel(callback)
+        self.inflight -= 1
+        self._dispatch()
+
+    def _dispatch(self):
+        while self.inflight < self.depth and not self.waiting:
+            # smallest tag first, the heavier class on a tie
+            best = None
+            for cls in self.classes.itervalues():
+                if cls.pending and (best is None or (cls.pending[0][0], -cls.weight) < (best.pending[0][0], -best.weight)):
+                    best = cls
+            if best is None:
+                return
+            tag, cost, call, d = best.pending[0]
+            callback = lambda result, d = d: self._done(d, result)
+            ioprio = self.queue.ioprio
+            self.queue.ioprio = best.ioprio
+            try:
+                call[0](*call[1:], callback = callback)
+            except QueueError:
+                self.waiting = True
+                self.queue.waitForSlots().addCallback(self._slotsFreed)
+                return
+            except IOError, e:
+                best.pending.popleft()
+                d.errback(failure.Failure(e))
+                continue
+            finally:
+                self.queue.ioprio = ioprio
+            best.pending.popleft()
+            best.bytes += cost
+            self.submitted[d] = callback
+            self.vtime = tag
+            self.inflight += 1
+
+    def _slotsFreed(self, _):
+        self.waiting = False
+        self._dispatch()
+
+    def _done(self, d, result):
+        del self.submitted[d]
+        self.inflight -= 1
+        if isinstance(result, Exception):
+            d.errback(failure.Failure(result))
+        else:
+            d.callback(result)
+        self._dispatch()
@@ -8,11 +8,22 @@
 
 */
 
+/* fallocate(2) is a GNU extension, declared only with this */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include <Python.h>
 #include <structmember.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 
 #include "libasyio.c"
+#include "libasyuring.c"
 
 /* ================================================================================
 
@@ -25,6 +36,7 @@ static PyObject *Deferred; /* twisted.internet.defer.Deferred */
 static PyObject *DeferredList; /* twisted.internet.defer.DeferredList */
 
 int PAGESIZE;
+static int uringAvailable; /* io_uring engine usable on this kernel */
 
 /* End of module globals */
 
@@ -50,6 +62,40 @@ PyErr_SetFromAIOError(int n) {
 
    ================================================================================ */
 
+/*
+  A number of operations completing as a whole: the Deferred fires
+  once, after the last member completed. A group can hold back a
+  trailer iocb, submitted only after all other members succeeded.
+*/
+typedef struct {
+  PyObject *defer; /* fired with results or total, or errback'ed with error */
+  unsigned int flags; /* QUEUE_SLOT_CALLBACK if defer is a plain callable */
+  PyObject *results; /* list of member results, or NULL */
+  PyObject *error; /* first failure */
+  unsigned int pending; /* members not completed yet */
+  long total; /* bytes transferred by members */
+  struct iocb *trailer;
+} QueueGroup;
+
+/* Per-iocb bookkeeping, indexed like Queue.iocbs */
+typedef struct {
+  unsigned int flags; /* QUEUE_SLOT_* */
+  QueueGroup *group; /* NULL, or the group this iocb belongs to */
+  unsigned int index; /* position in group->results */
+  struct iovec *iov; /* buffers of a vectored operation */
+  unsigned int iovcnt;
+  PyObject *owner; /* object owning the buffer, if it is not pooled */
+  Py_buffer view; /* target of scheduleReadInto, view.obj is NULL otherwise */
+  unsigned int skip; /* bytes read in front of the requested ones */
+  unsigned int length; /* bytes requested by a read */
+} QueueSlot;
+
+#define QUEUE_SLOT_ZEROCOPY (1 << 0) /* pass a Buffer instead of a string */
+#define QUEUE_SLOT_CALLBACK (1 << 1) /* aio_data is a callable, not a Deferred */
+#define QUEUE_SLOT_TOKEN (1 << 2) /* aio_data is a token for processEvents */
+#define QUEUE_SLOT_CANCELLED (1 << 3) /* nobody waits for the result any more */
+#define QUEUE_SLOT_LAST (1 << 4) /* last iocb of a read, may stop at end of file */
+
 typedef struct {
   PyObject_HEAD
 
@@ -57,19 +103,262 @@ typedef struct {
   unsigned int maxIO; /* maximum number of handled events */
   unsigned int busy; /* current handled events */
   unsigned int fd; /* notification fd */
+  char *engine; /* "aio" or "uring" */
+
+  unsigned int bufferSize; /* size of a single pooled buffer */
+  unsigned int bufferCount; /* number of pooled buffers */
+  unsigned int poolHits; /* buffers taken from the pool */
+  unsigned int poolMisses; /* buffers which had to be valloc'ed */
+
+  unsigned int flushThreshold; /* staged iocbs that trigger a flush, 0 = no staging */
+  unsigned int flushes; /* number of flushes of the staging area */
+  unsigned int submitCalls; /* io_submit (or io_uring_enter) calls */
+  unsigned int submitted; /* iocbs accepted by the kernel */
+
+  unsigned int alignment; /* reads are widened to multiples of this */
+  int ioprio; /* kernel I/O priority of new operations, 0 = the process' */
 
   /* private */
   aio_context_t *ctx;
+  struct asyuring *uring; /* io_uring engine, or NULL for KAIO */
+
+  struct iocb *iocbs; /* maxIO iocbs, cache-line aligned */
+  unsigned int *iocbFree; /* stack of free iocb indexes */
+  unsigned int iocbFreeTop;
+  QueueSlot *slots; /* maxIO slots, one per iocb */
+
+  char *pool; /* mmap'ed region, bufferCount * poolStride bytes */
+  unsigned int poolStride; /* bufferSize plus room for widening a read */
+  unsigned int *poolFree; /* stack of free buffer indexes */
+  unsigned int poolFreeTop;
 
-  struct iocb *iocbs;
+  PyObject *callArgs; /* argument tuple reused by Queue_call */
+  PyObject *completionHandler; /* called with the token completions */
+  PyObject *waiters; /* FIFO of (slots, Deferred) waiting for free slots */
+
+  struct io_event *reaped; /* maxIO events collected by reapEvents */
+  unsigned int reapedCount;
+  int reaping; /* reapEvents was used, processEvents only drains reaped */
+
+  struct iocb **staged; /* maxIO iocbs waiting for the next flush */
+  unsigned int stagedCount;
+  PyObject *flushHook; /* called when the staging area stops being empty */
+
+  pthread_mutex_t submitLock; /* serializes io_uring submissions */
+  pthread_mutex_t reapLock; /* serializes completion reaping */
 
 } Queue;
 
+#define Queue_slot(self, iocb) ((self)->slots + ((iocb) - (self)->iocbs))
+
+#define Queue_calcAlignedSize(size) (size % PAGESIZE) ?  (size + (PAGESIZE - size % PAGESIZE)) : size
+
+/*
+  Get a page-aligned buffer of at least size bytes. Buffers come from
+  the pool if they fit and there is one free, otherwise from valloc.
+*/
+static char *
+Queue_getBuffer(Queue *self, unsigned int size)
+{
+  if (size <= self->poolStride && self->poolFreeTop > 0) {
+    self->poolHits ++;
+    return self->pool + (size_t)self->poolFree[--self->poolFreeTop] * self->poolStride;
+  }
+  self->poolMisses ++;
+  return valloc(size);
+}
+
+/* Give back a buffer returned by Queue_getBuffer. */
+static void
+Queue_putBuffer(Queue *self, char *buf)
+{
+  if (buf == NULL)
+    return;
+  if (buf >= self->pool && buf < self->pool + (size_t)self->bufferCount * self->poolStride)
+    self->poolFree[self->poolFreeTop++] = (buf - self->pool) / self->poolStride;
+  else
+    free(buf);
+}
+
+/*
+  Take an iocb from the preallocated ring. Submission is bounded by
+  maxIO, so the ring can only run dry if the caller got busy wrong.
+*/
+static struct iocb *
+Queue_getIocb(Queue *self)
+{
+  if (self->iocbFreeTop == 0)
+    return NULL;
+  return self->iocbs + self->iocbFree[--self->iocbFreeTop];
+}
+
+static void
+Queue_putIocb(Queue *self, struct iocb *iocb)
+{
+  iocb->aio_data = 0; /* so Queue.cancel never matches a free iocb */
+  self->iocbFree[self->iocbFreeTop++] = iocb - self->iocbs;
+}
+
+/* Give back the buffers of an iocb, vectored or not. */
+static void
+Queue_putIocbBuffers(Queue *self, struct iocb *iocb)
+{
+  QueueSlot *slot = Queue_slot(self, iocb);
+  unsigned int i;
+
+  if (slot->owner) {
+    /* borrowed memory, only the reference is held */
+    Py_CLEAR(slot->owner);
+    return;
+  }
+  if (slot->view.obj) {
+    PyBuffer_Release(&slot->view);
+    return;
+  }
+  if (slot->iov == NULL) {
+    Queue_putBuffer(self, (char *)iocb->aio_buf);
+    return;
+  }
+  for (i = 0; i < slot->iovcnt; i++)
+    Queue_putBuffer(self, slot->iov[i].iov_base);
+  free(slot->iov);
+  slot->iov = NULL;
+  slot->iovcnt = 0;
+}
+
+/*
+  io_submit(2), or its io_uring counterpart. io_submit may block when
+  the device runs out of requests, so the GIL is released: callers
+  must have taken everything they need from the Queue, including
+  their share of busy, beforehand. Any other thread may complete the
+  iocbs before this returns.
+*/
+static long
+Queue_submit(Queue *self, long n, struct iocb **ios)
+{
+  long res;
+
+  Py_BEGIN_ALLOW_THREADS
+  if (self->uring) {
+    pthread_mutex_lock(&self->submitLock);
+    res = asyuring_submit(self->uring, n, ios);
+    pthread_mutex_unlock(&self->submitLock);
+  } else
+    res = io_submit(*self->ctx, n, ios);
+  Py_END_ALLOW_THREADS
+  self->submitCalls += 1;
+  if (res > 0)
+    self->submitted += res;
+  return res;
+}
+
+static long Queue_reapEventsLocked(Queue *self, long minEvents, long maxEvents,
+                                   struct io_event *events, struct timespec *ts);
+
+/*
+  io_getevents(2), or its io_uring counterpart. Call without the GIL;
+  only one thread at a time reads the completion ring.
+*/
+static long
+Queue_getEvents(Queue *self, long minEvents, long maxEvents,
+                struct io_event *events, struct timespec *ts)
+{
+  long res;
+
+  pthread_mutex_lock(&self->reapLock);
+  res = Queue_reapEventsLocked(self, minEvents, maxEvents, events, ts);
+  pthread_mutex_unlock(&self->reapLock);
+  return res;
+}
+
+static long
+Queue_reapEventsLocked(Queue *self, long minEvents, long maxEvents,
+                       struct io_event *events, struct timespec *ts)
+{
+  long n, res;
+
+  if (self->uring)
+    return asyuring_getevents(self->uring, minEvents, maxEvents, events, ts);
+
+  /*
+   Completions already in the ring are read from userspace. The
+   syscall is only needed to wait for more, or to have bogus
+   arguments refused.
+  */
+  if (minEvents < 0 || maxEvents < 1 || minEvents > maxEvents ||
+      (n = io_reap_ring(*self->ctx, maxEvents, events)) < 0)
+    return io_getevents(*self->ctx, minEvents, maxEvents, events, ts);
+  if (n >= minEvents)
+    return n;
+  res = io_getevents(*self->ctx, minEvents - n, maxEvents - n, events + n, ts);
+  if (res < 0)
+    return n ? n : res;
+  return n + res;
+}
+
+/*
+  The Python-level Queue sets flushHook to one of its own bound
+  methods, so the references held here are visited for the cycle
+  collector.
+*/
+static int
+Queue_traverse(Queue *self, visitproc visit, void *arg)
+{
+  Py_VISIT(self->flushHook);
+  Py_VISIT(self->completionHandler);
+  Py_VISIT(self->waiters);
+  Py_VISIT(self->callArgs);
+  return 0;
+}
+
+static int
+Queue_clear(Queue *self)
+{
+  Py_CLEAR(self->flushHook);
+  Py_CLEAR(self->completionHandler);
+  Py_CLEAR(self->waiters);
+  Py_CLEAR(self->callArgs);
+  return 0;
+}
 
 static void
 Queue_dealloc(Queue* self)
 {
-  io_destroy(*self->ctx);
+  unsigned int a;
+
+  PyObject_GC_UnTrack(self);
+  if (self->uring) {
+    asyuring_destroy(self->uring);
+    free(self->uring);
+  } else if (*self->ctx)
+    io_destroy(*self->ctx);
+  if (self->fd != -1)
+    close(self->fd);
+  if (self->iocbs)
+    free(self->iocbs);
+  if (self->iocbFree)
+    free(self->iocbFree);
+  if (self->slots) {
+    /* the context is gone, so is any read into a target */
+    for (a = 0; a < self->maxIO; a++)
+      if (self->slots[a].view.obj)
+        PyBuffer_Release(&self->slots[a].view);
+    free(self->slots);
+  }
+  Py_XDECREF(self->callArgs);
+  Py_XDECREF(self->completionHandler);
+  Py_XDECREF(self->waiters);
+  if (self->reaped)
+    free(self->reaped);
+  if (self->staged)
+    free(self->staged);
+  Py_XDECREF(self->flushHook);
+  pthread_mutex_destroy(&self->submitLock);
+  pthread_mutex_destroy(&self->reapLock);
+  if (self->pool)
+    munmap(self->pool, (size_t)self->bufferCount * self->poolStride);
+  if (self->poolFree)
+    free(self->poolFree);
   self->ob_type->tp_free((PyObject*)self);
 }
 
@@ -83,6 +372,33 @@ Queue_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     self->maxIO = 32;
     self->busy = 0;
     self->fd = -1;
+    self->engine = "aio";
+    self->uring = NULL;
+    self->bufferSize = 16 * PAGESIZE;
+    self->bufferCount = 0;
+    self->poolHits = self->poolMisses = 0;
+    self->pool = NULL;
+    self->poolStride = 0;
+    self->poolFree = NULL;
+    self->poolFreeTop = 0;
+    self->iocbs = NULL;
+    self->iocbFree = NULL;
+    self->iocbFreeTop = 0;
+    self->slots = NULL;
+    self->callArgs = NULL;
+    self->completionHandler = NULL;
+    self->waiters = NULL;
+    self->reaped = NULL;
+    self->reapedCount = 0;
+    self->reaping = 0;
+    self->staged = NULL;
+    self->stagedCount = 0;
+    self->flushHook = NULL;
+    self->flushThreshold = self->flushes = self->submitCalls = self->submitted = 0;
+    self->alignment = 4096;
+    self->ioprio = 0;
+    pthread_mutex_init(&self->submitLock, NULL);
+    pthread_mutex_init(&self->reapLock, NULL);
     self->ctx = malloc(sizeof(aio_context_t));
     if (self->ctx==NULL) {
       Py_DECREF(self);
@@ -97,15 +413,27 @@ Queue_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 static int
 Queue_init(Queue *self, PyObject *args, PyObject *kwds)
 {
-  int res;
-  static char *kwlist[] = {"maxIO", NULL};
+  int res, bufferSize = self->bufferSize, bufferCount = -1;
+  unsigned int a;
+  char *engine = "aio";
+  static char *kwlist[] = {"maxIO", "bufferSize", "bufferCount", "engine", "flushThreshold", "alignment", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiisiI", kwlist, &self->maxIO,
+                                   &bufferSize, &bufferCount, &engine, &self->flushThreshold,
+                                   &self->alignment))
+    return -1;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &self->maxIO))
+  if (self->alignment == 0) {
+    PyErr_SetString(PyExc_ValueError, "alignment must be positive");
     return -1;
+  }
 
-  res = io_setup(self->maxIO, self->ctx);
-  if (res < 0)  {
-    PyErr_SetFromAIOError(res);
+  if (strcmp(engine, "aio") && strcmp(engine, "uring")) {
+    PyErr_Format(PyExc_ValueError, "unknown engine '%s'", engine);
+    return -1;
+  }
+  if ((int)self->maxIO <= 0) { /* io_setup would refuse it too */
+    PyErr_SetFromAIOError(-EINVAL);
     return -1;
   }
 
@@ -116,227 +444,1626 @@ Queue_init(Queue *self, PyObject *args, PyObject *kwds)
   }
   fcntl(self->fd, F_SETFL, fcntl(self->fd, F_GETFL, 0) | O_NONBLOCK);
 
+  /*
+   io_uring is used if asked for and the kernel supports it, KAIO
+   otherwise. Both report completions on the same eventfd.
+  */
+  if (!strcmp(engine, "uring") && uringAvailable) {
+    self->uring = malloc(sizeof(struct asyuring));
+    if (self->uring == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    res = asyuring_setup(self->uring, self->maxIO, self->fd);
+    if (res == 0)
+      self->engine = "uring";
+    else {
+      free(self->uring);
+      self->uring = NULL;
+    }
+  }
+  if (self->uring == NULL) {
+    res = io_setup(self->maxIO, self->ctx);
+    if (res < 0)  {
+      PyErr_SetFromAIOError(res);
+      return -1;
+    }
+  }
+
+  /*
+   One iocb per slot, in a single cache-line aligned array, so scheduling
+   and completing operations does not touch the heap.
+  */
+  if (posix_memalign((void **)&self->iocbs, 64, self->maxIO * sizeof(struct iocb))) {
+    self->iocbs = NULL;
+    PyErr_NoMemory();
+    return -1;
+  }
+  memset(self->iocbs, 0, self->maxIO * sizeof(struct iocb));
+  self->iocbFree = malloc(self->maxIO * sizeof(unsigned int));
+  self->slots = calloc(self->maxIO, sizeof(QueueSlot));
+  self->reaped = malloc(self->maxIO * sizeof(struct io_event));
+  self->staged = malloc(self->maxIO * sizeof(struct iocb *));
+  if (self->iocbFree == NULL || self->slots == NULL || self->reaped == NULL ||
+      self->staged == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  for (a = 0; a < self->maxIO; a++)
+    self->iocbFree[a] = self->maxIO - a - 1;
+  self->iocbFreeTop = self->maxIO;
+
+  /*
+   Buffer pool: bufferCount page-aligned buffers of bufferSize bytes,
+   carved out of one anonymous mapping. By default there is one buffer
+   per maxIO slot. Each buffer has alignment bytes more, so a chunk of
+   bufferSize bytes still fits once its read is widened.
+  */
+  if (bufferSize < 0) {
+    PyErr_SetString(PyExc_ValueError, "bufferSize < 0");
+    return -1;
+  }
+  if (bufferCount < 0)
+    bufferCount = self->maxIO;
+  self->bufferSize = Queue_calcAlignedSize(bufferSize);
+  self->bufferCount = self->bufferSize ? bufferCount : 0;
+  self->poolStride = Queue_calcAlignedSize(self->alignment);
+  self->poolStride += self->bufferSize;
+
+  if (self->bufferCount) {
+    self->pool = mmap(NULL, (size_t)self->bufferCount * self->poolStride,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (self->pool == MAP_FAILED) {
+      self->pool = NULL;
+      self->bufferCount = 0;
+      PyErr_SetFromErrno(PyExc_IOError);
+      return -1;
+    }
+    self->poolFree = malloc(self->bufferCount * sizeof(unsigned int));
+    if (self->poolFree == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    for (a = 0; a < self->bufferCount; a++)
+      self->poolFree[a] = self->bufferCount - a - 1;
+    self->poolFreeTop = self->bufferCount;
+  }
+
   return 0;
 }
 
-#define Queue_calcAlignedSize(size) (size % PAGESIZE) ?  (size + (PAGESIZE - size % PAGESIZE)) : size
+/*
+  A new Deferred, whose cancel() cancels the operations it stands for.
+  See Queue.cancel .
+*/
+static PyObject *
+Queue_newDeferred(Queue *self)
+{
+  PyObject *attrlist, *kwargs, *defer;
+
+  attrlist = Py_BuildValue("()");
+  kwargs = Py_BuildValue("{sN}", "canceller", PyObject_GetAttrString((PyObject *)self, "cancel"));
+  defer = attrlist && kwargs ? PyInstance_New(Deferred, attrlist, kwargs) : NULL;
+  Py_XDECREF(attrlist);
+  Py_XDECREF(kwargs);
+  return defer;
+}
+
+/*
+  Allocate a group with its Deferred, or with callback instead if it
+  is not NULL. If withResults is true, the group will fire with a list
+  of pending member results.
+*/
+static QueueGroup *
+Queue_newGroup(Queue *self, unsigned int pending, int withResults, PyObject *callback)
+{
+  QueueGroup *group;
 
-#define Queue_processEvents_CLEANUP {           \
-    if (iocb) free(iocb); if (buf) free(buf);   \
-    Py_XDECREF(defer);                          \
-    for (cup=a+1;cup<e;cup++) {                 \
-      iocb = (struct iocb *)events[a].obj;      \
-      defer = (PyObject *)iocb->aio_data;       \
-      buf = (char *)iocb->aio_buf;              \
-      free(iocb); free(buf); Py_XDECREF(defer); \
-    }                                           \
+  group = calloc(1, sizeof(QueueGroup));
+  if (group == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  if (callback) {
+    Py_INCREF(callback);
+    group->defer = callback;
+    group->flags = QUEUE_SLOT_CALLBACK;
+  } else
+    group->defer = Queue_newDeferred(self);
+  if (withResults)
+    group->results = PyList_New(pending);
+  if (group->defer == NULL || (withResults && group->results == NULL)) {
+    Py_XDECREF(group->defer);
+    Py_XDECREF(group->results);
+    free(group);
+    return NULL;
   }
+  group->pending = pending;
+  return group;
+}
 
-PyObject *
-Queue_processEvents(Queue *self, PyObject *args, PyObject *kwds)
+/* Drop a group which never got submitted. */
+static void
+Queue_freeGroup(QueueGroup *group)
 {
-  static char *kwlist[] = {"minEvents", "maxEvents", "timeoutNSec", NULL};
-  int minEvents = 1, maxEvents = 16;
-  PyObject *ret = NULL;
-  struct timespec io_ts;
-  io_ts.tv_sec = 0;
-  io_ts.tv_nsec = 5000;
-  int a, e, cup;
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iii", kwlist,
-                                   &minEvents, &maxEvents, &io_ts.tv_nsec))
-    return NULL;
+  Py_XDECREF(group->defer);
+  Py_XDECREF(group->results);
+  Py_XDECREF(group->error);
+  free(group);
+}
 
-  struct io_event events[maxEvents];
-  e = io_getevents(*self->ctx, minEvents, maxEvents, events, &io_ts);
-  if (e < 0) {
-    PyErr_SetFromAIOError(e);
+static PyObject *Buffer_create(Queue *queue, char *base, char *data, Py_ssize_t size);
+static PyTypeObject BufferType;
+static PyTypeObject StagingType;
+
+/* Take the current exception out of the interpreter, as an instance. */
+static PyObject *
+Queue_fetchError(void)
+{
+  PyObject *t, *v, *tb;
+
+  PyErr_Fetch(&t, &v, &tb);
+  PyErr_NormalizeException(&t, &v, &tb);
+  Py_XDECREF(t); Py_XDECREF(tb);
+  if (v == NULL) {
+    Py_INCREF(Py_None);
+    v = Py_None;
+  }
+  return v;
+}
+
+/*
+  Call target(result) without building an argument tuple for every
+  completion: METH_O builtins (like list.append) are called directly,
+  anything else gets the Queue's cached 1-tuple, unless the previous
+  callee kept a reference to it.
+*/
+static PyObject *
+Queue_call(Queue *self, PyObject *target, PyObject *result)
+{
+  PyObject *args, *ret;
+
+  if (PyCFunction_Check(target) && PyCFunction_GET_FLAGS(target) == METH_O)
+    return (*PyCFunction_GET_FUNCTION(target))(PyCFunction_GET_SELF(target), result);
+
+  /* ours until the call returns, a nested call makes its own */
+  args = self->callArgs;
+  self->callArgs = NULL;
+  if (args == NULL && (args = PyTuple_New(1)) == NULL)
     return NULL;
+  Py_INCREF(result);
+  PyTuple_SET_ITEM(args, 0, result);
+  ret = PyObject_Call(target, args, NULL);
+  if (Py_REFCNT(args) == 1 && self->callArgs == NULL) {
+    /* nobody kept it, keep it for the next call */
+    PyTuple_SET_ITEM(args, 0, NULL);
+    Py_DECREF(result);
+    self->callArgs = args;
+  } else
+    Py_DECREF(args);
+  return ret;
+}
+
+/*
+  Call defer.callback(result) or defer.errback(result), or, for
+  QUEUE_SLOT_CALLBACK targets, target(result) - failures being passed
+  as exception instances. Nothing is called for QUEUE_SLOT_CANCELLED
+  targets. Steals both references.
+*/
+static int
+Queue_fire(Queue *self, PyObject *target, unsigned int flags, PyObject *result, int failed)
+{
+  PyObject *method, *arglist, *ret;
+
+  if (flags & QUEUE_SLOT_CANCELLED) {
+    Py_DECREF(result);
+    Py_DECREF(target);
+    return 0;
   }
 
-  if (e == 0)
-    Py_RETURN_NONE;
+  if (flags & QUEUE_SLOT_CALLBACK) {
+    ret = Queue_call(self, target, result);
+    Py_DECREF(result);
+    Py_DECREF(target);
+    if (ret == NULL)
+      return -1;
+    Py_DECREF(ret);
+    return 0;
+  }
+
+  method = PyObject_GetAttrString(target, failed ? "errback" : "callback");
+  if (method == NULL) { /* Not a Deferred? */
+    PyErr_Format(PyExc_TypeError, "Object passed to Queue.schedule was not a twisted.internet.defer.Deferred object (no %s attribute).", failed ? "errback" : "callback");
+    Py_DECREF(result);
+    Py_DECREF(target);
+    return -1;
+  }
+  arglist = Py_BuildValue("(N)", result);
+  ret = arglist ? PyEval_CallObject(method, arglist) : NULL;
+  Py_XDECREF(arglist);
+  Py_DECREF(method);
+  Py_DECREF(target);
+  if (ret == NULL)
+    return -1;
+  Py_DECREF(ret);
+  return 0;
+}
+
+/* Submit the iocb a group held back until its other members completed. */
+static int
+Queue_submitTrailer(Queue *self, QueueGroup *group)
+{
+  struct iocb *io = group->trailer;
+  int res;
+
+  group->trailer = NULL;
+  group->pending = 1;
+  Queue_slot(self, io)->group = group;
+  res = Queue_submit(self, 1, &io);
+  if (res < 1) {
+    Queue_slot(self, io)->group = NULL;
+    Queue_putIocb(self, io);
+    self->busy -= 1;
+    group->pending = 0;
+    PyErr_SetFromAIOError(res ? res : -EAGAIN);
+    group->error = Queue_fetchError();
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Record the outcome of one member of a group. Once every member
+  completed, either submit the trailer or fire the group's Deferred.
+  Steals the reference to result.
+*/
+static int
+Queue_groupDone(Queue *self, QueueGroup *group, unsigned int index,
+                PyObject *result, int failed)
+{
+  PyObject *defer;
+  unsigned int flags;
+
+  if (failed) {
+    if (group->error == NULL)
+      group->error = result;
+    else
+      Py_DECREF(result);
+  } else if (group->results) {
+    PyList_SET_ITEM(group->results, index, result);
+  } else {
+    if (PyInt_Check(result))
+      group->total += PyInt_AS_LONG(result);
+    Py_DECREF(result);
+  }
+
+  if (--group->pending)
+    return 0;
+
+  if (group->trailer && group->error == NULL && !(group->flags & QUEUE_SLOT_CANCELLED) &&
+      Queue_submitTrailer(self, group) == 0)
+    return 0;
+  if (group->trailer) { /* a member failed, trailer was never submitted */
+    Queue_putIocb(self, group->trailer);
+    self->busy -= 1;
+  }
+
+  defer = group->defer;
+  flags = group->flags;
+  if (group->error) {
+    result = group->error;
+    Py_XDECREF(group->results);
+  } else if (group->results)
+    result = group->results;
+  else
+    result = PyInt_FromLong(group->total);
+  failed = group->error != NULL;
+  free(group);
+  if (result == NULL) {
+    Py_DECREF(defer);
+    return -1;
+  }
+  return Queue_fire(self, defer, flags, result, failed);
+}
+
+/*
+  Fire the waiters registered by waitForSlots, in order, as long as
+  there are enough free slots for the first one. Each is fired with
+  the number of free slots, and may use them right away.
+*/
+static int
+Queue_drainWaiters(Queue *self)
+{
+  PyObject *waiter, *defer, *result;
+  unsigned int slots;
+
+  while (self->waiters && PyList_GET_SIZE(self->waiters) > 0) {
+    waiter = PyList_GET_ITEM(self->waiters, 0);
+    slots = PyInt_AS_LONG(PyTuple_GET_ITEM(waiter, 0));
+    if (self->busy + slots > self->maxIO)
+      break;
+    defer = PyTuple_GET_ITEM(waiter, 1);
+    Py_INCREF(defer);
+    if (PyList_SetSlice(self->waiters, 0, 1, NULL) < 0) {
+      Py_DECREF(defer);
+      return -1;
+    }
+    result = PyInt_FromLong(self->maxIO - self->busy);
+    if (result == NULL) {
+      Py_DECREF(defer);
+      return -1;
+    }
+    if (Queue_fire(self, defer, 0, result, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+  Fire callbacks for e events taken off the ring, and for iocbs that
+  could not be submitted. Returns what processEvents returns.
+*/
+static PyObject *
+Queue_deliverEvents(Queue *self, struct io_event *events, int e)
+{
+  PyObject *errType = NULL, *errValue = NULL, *errTb = NULL;
+  PyObject *completed = NULL; /* (token, result, data) tuples */
+  int a;
 
+  self->busy -= e;
+
+  /*
+   Every event is delivered, even if an earlier callback failed, so
+   no buffer, iocb or Deferred is lost. The first error is re-raised
+   once all events were processed.
+  */
   for (a=0;a<e;a++) {
     struct iocb *iocb;
-    uint iosize, alignedSize;
+    QueueSlot *slot;
+    QueueGroup *group;
+    uint iosize, i, index, flags;
     char *buf;
-    off_t offset;
-    PyObject *defer, *arglist, *string;
-    int rc, sc, opcode;
+    PyObject *defer, *arglist, *result;
+    int rc, sc, opcode, failed;
+    long done = events[a].res; /* bytes passed on */
 
     iocb = (struct iocb *)events[a].obj;
+    slot = Queue_slot(self, iocb);
     defer = (PyObject *)iocb->aio_data;
+    group = slot->group;
+    index = slot->index;
+    flags = slot->flags;
+    slot->group = NULL;
     iosize = iocb->aio_nbytes;
-    alignedSize = Queue_calcAlignedSize(iosize); /* bytes missing till the end of page */
     buf = (char *)iocb->aio_buf;
-    offset = iocb->aio_offset;
     opcode = iocb->aio_lio_opcode;
+    if (slot->iov)
+      for (iosize = 0, i = 0; i < slot->iovcnt; i++)
+        iosize += slot->iov[i].iov_len;
     rc = events[a].res2; sc = events[a].res != iosize;
-
-    if (rc || sc) {
-
-      PyObject *errback, *exception;
-
-      errback = PyObject_GetAttrString(defer, "errback");
-      if (errback == NULL) { /* Not a Deferred? */
-        PyErr_SetString(PyExc_TypeError, "Object passed to Queue.schedule was not a twisted.internet.defer.Deferred object (no errback attribute).");
-        Queue_processEvents_CLEANUP;
-        return NULL;
+    if (opcode == IOCB_CMD_PREAD) /* widened reads only need what was asked for */
+      sc = events[a].res < (long)(slot->skip + slot->length);
+    if (!rc && events[a].res < 0) /* failed with -errno */
+      rc = events[a].res;
+    if ((opcode == IOCB_CMD_PREAD || opcode == IOCB_CMD_PREADV) &&
+        (flags & QUEUE_SLOT_LAST) && events[a].res >= 0)
+      sc = 0; /* the last chunk of a read stopped at the end of file */
+
+    if ((failed = rc || sc)) {
+
+      Queue_putIocbBuffers(self, iocb);
+
+      /* iosize = expected; events[a].res = really processed; */
+      if (rc)
+        arglist = Py_BuildValue("(is)", rc < 0 ? -rc : rc, strerror(rc < 0 ? -rc : rc));
+      else
+        arglist = Py_BuildValue("(N)", PyString_FromFormat("Missing bytes: should %s %i, got %i.", opcode == IOCB_CMD_PWRITE || opcode == IOCB_CMD_PWRITEV ? "write" : "read", iosize, (int)events[a].res));
+      result = arglist ? PyEval_CallObject(PyExc_IOError, arglist) : NULL;
+      Py_XDECREF(arglist);
+
+    } else if (opcode == IOCB_CMD_PREAD) {
+      /*
+       Copy the buffer to a string and pass it to callback,
+       then return the buffer to the pool. In zero-copy mode
+       the buffer is handed over to a Buffer object instead, which
+       gives it back when it is released.
+      */
+      done = events[a].res > slot->skip ? events[a].res - slot->skip : 0;
+      if (done > slot->length)
+        done = slot->length;
+      if (slot->view.obj) {
+        /* read into memory of the caller, see scheduleReadInto */
+        PyBuffer_Release(&slot->view);
+        result = PyInt_FromLong(done);
+      } else if (slot->flags & QUEUE_SLOT_ZEROCOPY)
+        result = Buffer_create(self, buf, buf + slot->skip, done);
+      else {
+        result = PyString_FromStringAndSize(buf + slot->skip, done);
+        Queue_putBuffer(self, buf);
       }
-
-      if (rc) 
-        exception = PyErr_SetFromAIOError(rc);
-      else if (sc) {
-        PyObject *excargs;
-        /* iosize = expected; events[a].res = really processed; */
-        //exception = PyErr_Format(PyExc_IOError, "Missing bytes: should read %i, got %i.", iosize, events[a].res);
-        arglist = Py_BuildValue("(O)", PyString_FromFormat("Missing bytes: should read %i, got %i.", iosize, events[a].res));
-        exception = PyEval_CallObject(PyExc_IOError, arglist);
-        if (exception == NULL) {
-          Queue_processEvents_CLEANUP;
-          return PyErr_NoMemory();
+    } else if (opcode == IOCB_CMD_PREADV) {
+      /*
+       Same as above, one list item per iovec. The bytes read fill
+       the iovecs in order, so after a short read the tail items are
+       shorter, or empty.
+      */
+      long left = events[a].res;
+
+      result = PyList_New(slot->iovcnt);
+      for (i = 0; i < slot->iovcnt; i++) {
+        PyObject *item = NULL;
+        char *base = slot->iov[i].iov_base;
+        long len = left < (long)slot->iov[i].iov_len ? left : (long)slot->iov[i].iov_len;
+
+        left -= len;
+        if (result == NULL)
+          Queue_putBuffer(self, base);
+        else if (slot->flags & QUEUE_SLOT_ZEROCOPY)
+          item = Buffer_create(self, base, base, len);
+        else {
+          item = PyString_FromStringAndSize(base, len);
+          Queue_putBuffer(self, base);
         }
-      } else {
-        fprintf(stderr, "I should never be here.");
-        exit(1);
-      }
-
-      free(buf); free(iocb);
-      arglist = Py_BuildValue("(O)", exception);
-      ret = PyEval_CallObject(errback, arglist);
-      Py_DECREF(arglist);
-      Py_DECREF(exception);
-      Py_DECREF(errback);
-      if (ret == NULL) {
-        Queue_processEvents_CLEANUP;
-        return NULL;
+        if (result != NULL && item == NULL)
+          Py_CLEAR(result);
+        else if (result != NULL)
+          PyList_SET_ITEM(result, i, item);
       }
-      Py_XDECREF(ret);
-
+      free(slot->iov);
+      slot->iov = NULL;
+      slot->iovcnt = 0;
+    } else if (opcode == IOCB_CMD_PWRITE || opcode == IOCB_CMD_PWRITEV) {
+      /* Data is on disk, the staging buffers are not needed any more. */
+      Queue_putIocbBuffers(self, iocb);
+      result = PyInt_FromLong(iosize);
+    } else if (opcode == IOCB_CMD_FSYNC || opcode == IOCB_CMD_FDSYNC) {
+      Py_INCREF(Py_None);
+      result = Py_None;
     } else {
+      Queue_putIocbBuffers(self, iocb);
+      result = PyErr_Format(PyExc_SystemError, "unexpected opcode %i", opcode);
+    }
+    Queue_putIocb(self, iocb);
 
-      PyObject *callback;
-
-      if (opcode == IOCB_CMD_PREAD) {
-        /*
-         Copy the buffer to a string and pass it to callback.
-        */
-        string = PyString_FromStringAndSize(buf, iosize);
-        free(buf); 
-
-        arglist = Py_BuildValue("(O)", string);
-        if (defer == NULL) {
-          PyErr_SetString(PyExc_TypeError, "aio_data is NULL");
-          Py_XDECREF(string);
-          Queue_processEvents_CLEANUP;
-          return NULL;
-        }
-        callback = PyObject_GetAttrString(defer, "callback");
-        if (callback == NULL) { /* Not a Deferred? */
-          PyErr_SetString(PyExc_TypeError, "Object passed to Queue.schedule was not a twisted.internet.defer.Deferred object (no callback attribute).");
-          Queue_processEvents_CLEANUP;
-          return NULL;
-        }
-        ret = PyEval_CallObject(callback, arglist);
-        Py_DECREF(arglist);
-        Py_DECREF(callback);
-        Py_DECREF(string);
-        Py_DECREF(defer);
-
-        if (ret == NULL) {
-          Queue_processEvents_CLEANUP
-          return NULL;
-        }
-        Py_XDECREF(ret);
-      } else {
-        fprintf(stderr, "I should never, ever be here.");
-        exit(1);
+    if (result == NULL) {
+      /* could not even build the result, report that instead */
+      result = Queue_fetchError();
+      failed = 1;
+    }
+
+    if ((flags & QUEUE_SLOT_TOKEN) && !(flags & QUEUE_SLOT_CANCELLED)) {
+      /*
+       No Python code runs here, the completion is only recorded.
+       The batch is handed over in one go once all events are done.
+      */
+      PyObject *item;
+
+      if (failed)
+        item = Py_BuildValue("(NNO)", defer, result, Py_None);
+      else if (opcode == IOCB_CMD_PREAD || opcode == IOCB_CMD_PREADV)
+        item = Py_BuildValue("(NlN)", defer, done, result);
+      else {
+        Py_DECREF(result);
+        item = Py_BuildValue("(NlO)", defer, done, Py_None);
+      }
+      if (item != NULL && completed == NULL && (completed = PyList_New(0)) == NULL)
+        Py_CLEAR(item);
+      if (item == NULL || PyList_Append(completed, item) < 0) {
+        if (errType == NULL)
+          PyErr_Fetch(&errType, &errValue, &errTb);
+        else
+          PyErr_WriteUnraisable((PyObject *)self);
       }
+      Py_XDECREF(item);
+      continue;
     }
-  }
 
-  self->busy -= e;
+    if ((group ? Queue_groupDone(self, group, index, result, failed) :
+         Queue_fire(self, defer, flags, result, failed)) < 0) {
+      if (errType == NULL)
+        PyErr_Fetch(&errType, &errValue, &errTb);
+      else
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+  }
 
-  Py_RETURN_NONE;
-}
+  if (completed && self->completionHandler && self->completionHandler != Py_None) {
+    PyObject *ret = Queue_call(self, self->completionHandler, completed);
 
-#define Queue_scheduleRead_CLEANUP { for(cup=0;cup< a>0?a-1:0;cup++) { printf("TOTAL: %i, NOW: %i, TO: %i\n", chunks, cup, a); \
-      if (ioq[cup]->aio_buf) free(ioq[cup]->aio_buf); \
-      Py_XDECREF(deferreds[cup]); } if (ioq) free(ioq); if (deferreds) free(deferreds); }
+    Py_DECREF(completed);
+    completed = NULL;
+    if (ret == NULL) {
+      if (errType == NULL)
+        PyErr_Fetch(&errType, &errValue, &errTb);
+      else
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    Py_XDECREF(ret);
+  }
 
-static PyObject*
-Queue_scheduleRead(Queue *self, PyObject *args, PyObject *kwds) {
-  unsigned int fd, offset, chunks, chunkSize, a, cup;
-  static char *kwlist[] = {"fd", "offset", "chunks", "chunkSize", NULL};
+  /* slots were freed, let waiting streams submit */
+  if (Queue_drainWaiters(self) < 0) {
+    if (errType == NULL)
+      PyErr_Fetch(&errType, &errValue, &errTb);
+    else
+      PyErr_WriteUnraisable((PyObject *)self);
+  }
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iiii|", kwlist,
-                                   &fd, &offset, &chunks, &chunkSize))
-    return NULL;
+  if (errType && completed) {
+    /* the completions can not be lost, the error has to give way */
+    PyErr_Restore(errType, errValue, errTb);
+    PyErr_WriteUnraisable((PyObject *)self);
+    errType = NULL;
+  }
 
-  if ( self->busy + chunks > self->maxIO ) { 
-    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
-    return NULL;
-  }  else if ( chunks < 1 ) {
-    PyErr_SetString(PyExc_IOError, "chunks < 1");
+  if (errType) {
+    PyErr_Restore(errType, errValue, errTb);
     return NULL;
   }
 
-  struct iocb *ioq[chunks];
-  PyObject *deferreds[chunks];
-  PyObject *defer, *attrlist;
+  if (completed)
+    return completed;
 
-  for (a=0;a<chunks;a++) {
-    attrlist = Py_BuildValue("()");
-    deferreds[a] = PyInstance_New(Deferred, attrlist, NULL);
-    if (deferreds[a] == NULL) {
-      Queue_scheduleRead_CLEANUP;
-      return NULL;
+  Py_RETURN_NONE;
+}
+
+/*
+  Submit n iocbs, with as few syscalls as the kernel allows. What it
+  does not take is failed like a completion would be: the events are
+  kept for the next processEvents call and the eventfd is signalled,
+  so no callback fires from within a schedule call. Returns the
+  number of iocbs that failed.
+*/
+static int
+Queue_submitOrFail(Queue *self, unsigned int n, struct iocb **ioq)
+{
+  unsigned int done = 0, failed = 0;
+  long res;
+  u_int64_t count;
+
+  while (done < n) {
+    res = Queue_submit(self, n - done, ioq + done);
+    if (res > 0) {
+      done += res;
+      continue;
     }
-    Py_DECREF(attrlist);
+    /*
+     The first remaining iocb was refused. Fail it alone and go on,
+     unless the kernel is out of resources - then fail the rest too.
+     busy covers these, so there is room for them in reaped.
+    */
+    do {
+      struct io_event *ev = self->reaped + self->reapedCount++;
+      ev->obj = (u_int64_t)ioq[done];
+      ev->data = ioq[done]->aio_data;
+      ev->res = res < 0 ? res : -EAGAIN;
+      ev->res2 = 0;
+      done++;
+      failed++;
+    } while (done < n && (res == 0 || res == -EAGAIN));
   }
-  int alignedSize = Queue_calcAlignedSize(chunkSize); /* make sure we want N * PAGESIZE chunks */
 
-  char *buf ;
-  struct iocb *io;
+  if (failed) {
+    count = failed;
+    if (write(self->fd, &count, sizeof(count)) < 0)
+      ; /* the counter is already signalled */
+  }
+  return failed;
+}
 
-  for (a = 0; a < chunks; a++) {
+/* Submit the staging area with a single syscall, see above. */
+static int
+Queue_flush(Queue *self)
+{
+  unsigned int n = self->stagedCount;
+
+  if (n == 0)
+    return 0;
+  struct iocb *ioq[n];
+  memcpy(ioq, self->staged, n * sizeof(struct iocb *));
+  self->stagedCount = 0;
+  self->flushes += 1;
+  return Queue_submitOrFail(self, n, ioq);
+}
 
-    buf = valloc(alignedSize);
-    if (buf == NULL)  {
-      Queue_scheduleRead_CLEANUP;
-      return PyErr_NoMemory();
-    }
+/*
+  Submit, or stage until the next flush if staging is enabled. Returns
+  n, or -errno if nothing was submitted. Iocbs staged, or refused after
+  others were submitted, count as submitted for the caller; if the
+  kernel does not take them, they complete with an error instead.
+*/
+static long
+Queue_enqueue(Queue *self, long n, struct iocb **ios)
+{
+  PyObject *ret;
+  long i, res;
+
+  if (self->fd == -1)
+    return -EBADF; /* closed */
+  if (self->ioprio)
+    for (i = 0; i < n; i++)
+      asyio_set_ioprio(ios[i], self->ioprio);
+
+  if (self->flushThreshold == 0) {
+    res = Queue_submit(self, n, ios);
+    /* the kernel took only some, the rest go the way of a failed flush */
+    if (res >= 0 && res < n)
+      Queue_submitOrFail(self, n - res, ios + res);
+    return res < 0 ? res : n;
+  }
+
+  memcpy(self->staged + self->stagedCount, ios, n * sizeof(struct iocb *));
+  self->stagedCount += n;
+  if (self->stagedCount >= self->flushThreshold)
+    Queue_flush(self);
+  else if (self->stagedCount == n && self->flushHook && self->flushHook != Py_None) {
+    /* first one in, ask for a flush at the end of this reactor iteration */
+    ret = PyObject_CallObject(self->flushHook, NULL);
+    if (ret == NULL)
+      PyErr_WriteUnraisable(self->flushHook);
+    Py_XDECREF(ret);
+  }
+  return n;
+}
+
+PyObject *
+Queue_processEvents(Queue *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"minEvents", "maxEvents", "timeoutNSec", NULL};
+  int minEvents = 1, maxEvents = 16;
+  struct timespec io_ts;
+  io_ts.tv_sec = 0;
+  io_ts.tv_nsec = 5000;
+  int e;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iii", kwlist,
+                                   &minEvents, &maxEvents, &io_ts.tv_nsec))
+    return NULL;
+  if (maxEvents < 1) {
+    PyErr_SetString(PyExc_IOError, "maxEvents < 1");
+    return NULL;
+  }
+
+  /* staged iocbs would never complete otherwise */
+  if (self->stagedCount)
+    Queue_flush(self);
+
+  struct io_event events[maxEvents];
+  /*
+   Events collected by reapEvents, or iocbs a flush could not submit,
+   go first. If another thread owns the context, that is all.
+  */
+  e = self->reapedCount < maxEvents ? self->reapedCount : maxEvents;
+  if (e > 0) {
+    memcpy(events, self->reaped, e * sizeof(struct io_event));
+    self->reapedCount -= e;
+    memmove(self->reaped, self->reaped + e, self->reapedCount * sizeof(struct io_event));
+  }
+  if (!self->reaping && (e == 0 || e < maxEvents)) {
+    long n;
+    Py_BEGIN_ALLOW_THREADS
+    n = Queue_getEvents(self, e == 0 ? minEvents : (minEvents > e ? minEvents - e : 0),
+                        maxEvents - e, events + e, &io_ts);
+    Py_END_ALLOW_THREADS
+    if (n < 0 && e == 0) {
+      PyErr_SetFromAIOError(n);
+      return NULL;
+    }
+    if (n > 0)
+      e += n;
+  }
+
+  if (e == 0)
+    Py_RETURN_NONE;
+
+  return Queue_deliverEvents(self, events, e);
+}
+
+PyObject *
+Queue_reapEvents(Queue *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"minEvents", "maxEvents", "timeoutNSec", NULL};
+  int minEvents = 1, maxEvents = 16;
+  unsigned int room;
+  struct timespec io_ts;
+  long e;
+  io_ts.tv_sec = 0;
+  io_ts.tv_nsec = 5000;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iii", kwlist,
+                                   &minEvents, &maxEvents, &io_ts.tv_nsec))
+    return NULL;
+
+  /*
+   Only this thread appends to reaped, so there is at least room for
+   what is free now. Nothing but the kernel is touched without the GIL.
+  */
+  self->reaping = 1;
+  room = self->maxIO - self->reapedCount;
+  if (maxEvents > room)
+    maxEvents = room;
+  if (minEvents > maxEvents)
+    minEvents = maxEvents;
+  struct io_event events[maxEvents > 0 ? maxEvents : 1];
+  if (maxEvents < 1)
+    return PyInt_FromLong(0);
+
+  Py_BEGIN_ALLOW_THREADS
+  e = Queue_getEvents(self, minEvents, maxEvents, events, &io_ts);
+  Py_END_ALLOW_THREADS
+  if (e < 0) {
+    PyErr_SetFromAIOError(e);
+    return NULL;
+  }
+
+  memcpy(self->reaped + self->reapedCount, events, e * sizeof(struct io_event));
+  self->reapedCount += e;
+  return PyInt_FromLong(self->reapedCount);
+}
+
+#define Queue_scheduleRead_CLEANUP { for(cup=0;cup<a;cup++) {  \
+      Queue_putBuffer(self, (char *)ioq[cup]->aio_buf);        \
+      Queue_slot(self, ioq[cup])->group = NULL;                \
+      Queue_putIocb(self, ioq[cup]); }                         \
+    for(cup=0;cup<chunks;cup++) Py_XDECREF(deferreds[cup]);    \
+    if (group) Queue_freeGroup(group); }
+
+static PyObject*
+Queue_scheduleRead(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd, chunks, chunkSize, a, cup;
+  off_t offset;
+  int zeroCopy = 0, batch = 0;
+  QueueGroup *group = NULL;
+  PyObject *callback = NULL, *token = NULL;
+  static char *kwlist[] = {"fd", "offset", "chunks", "chunkSize", "zeroCopy", "batch", "callback", "token", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iLii|iiOO", kwlist,
+                                   &fd, &offset, &chunks, &chunkSize, &zeroCopy, &batch, &callback, &token))
+    return NULL;
+
+  if (callback == Py_None)
+    callback = NULL;
+  if (token == Py_None)
+    token = NULL;
+  if (callback && !PyCallable_Check(callback)) {
+    PyErr_SetString(PyExc_TypeError, "callback must be callable");
+    return NULL;
+  }
+  if (token && (callback || batch)) {
+    PyErr_SetString(PyExc_TypeError, "token can not be combined with callback or batch");
+    return NULL;
+  }
+  if (token && chunks > 1 && (!PySequence_Check(token) || PySequence_Size(token) != chunks)) {
+    PyErr_SetString(PyExc_TypeError, "token must be a sequence of one token per chunk");
+    return NULL;
+  }
+
+  if ( self->busy + chunks > self->maxIO ) { 
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    return NULL;
+  }  else if ( chunks < 1 ) {
+    PyErr_SetString(PyExc_IOError, "chunks < 1");
+    return NULL;
+  }
+
+  struct iocb *ioq[chunks];
+  PyObject *deferreds[chunks];
+
+  memset(deferreds, 0, sizeof(deferreds));
+  a = 0;
+  if (batch) {
+    /* one Deferred for the whole batch, fired by the last completion */
+    group = Queue_newGroup(self, chunks, 1, callback);
+    if (group == NULL)
+      return NULL;
+  }
+  for (cup=0;cup<chunks && !batch;cup++) {
+    if (callback) {
+      Py_INCREF(callback);
+      deferreds[cup] = callback;
+      continue;
+    }
+    if (token) {
+      if (chunks == 1) {
+        Py_INCREF(token);
+        deferreds[cup] = token;
+      } else if ((deferreds[cup] = PySequence_GetItem(token, cup)) == NULL) {
+        Queue_scheduleRead_CLEANUP;
+        return NULL;
+      }
+      continue;
+    }
+    deferreds[cup] = Queue_newDeferred(self);
+    if (deferreds[cup] == NULL) {
+      Queue_scheduleRead_CLEANUP;
+      return NULL;
+    }
+  }
+
+  char *buf ;
+  struct iocb *io;
+
+  for (a = 0; a < chunks; a++) {
+    /*
+     O_DIRECT refuses offsets and sizes which are not multiples of
+     the logical block size, so the read is widened to alignment;
+     only the requested bytes are passed on.
+    */
+    off_t start = offset - offset % self->alignment;
+    unsigned int size = offset + chunkSize - start;
+    size += (self->alignment - size % self->alignment) % self->alignment;
+    int alignedSize = Queue_calcAlignedSize(size); /* make sure we want N * PAGESIZE chunks */
+
+    buf = Queue_getBuffer(self, alignedSize);
+    if (buf == NULL)  {
+      Queue_scheduleRead_CLEANUP;
+      return PyErr_NoMemory();
+    }
     
-    io = malloc(sizeof(struct iocb));
+    io = Queue_getIocb(self);
     if (io == NULL) {
+      Queue_putBuffer(self, buf);
       Queue_scheduleRead_CLEANUP;
-      return PyErr_NoMemory();
+      PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+      return NULL;
     }
 
-    asyio_prep_pread(io, fd, buf, chunkSize, offset, self->fd);
-    io->aio_data = deferreds[a];
+    asyio_prep_pread(io, fd, buf, size, start, self->fd);
+    io->aio_data = (u_int64_t)deferreds[a];
+    Queue_slot(self, io)->flags = (zeroCopy ? QUEUE_SLOT_ZEROCOPY : 0) |
+      (callback ? QUEUE_SLOT_CALLBACK : 0) | (token ? QUEUE_SLOT_TOKEN : 0) |
+      (a == chunks - 1 ? QUEUE_SLOT_LAST : 0);
+    Queue_slot(self, io)->skip = offset - start;
+    Queue_slot(self, io)->length = chunkSize;
+    Queue_slot(self, io)->group = group;
+    Queue_slot(self, io)->index = a;
     ioq[a] = io;
     offset += chunkSize;
   }
-  self->busy += chunks;
-  int res = io_submit(*self->ctx, chunks, ioq);
+  /*
+   What is returned has to be referenced before submitting: once the
+   GIL is released, another thread may complete and free the iocbs.
+  */
+  PyObject *lst = NULL, *dlst, *arglist;
+  if (group) {
+    lst = group->defer;
+    Py_INCREF(lst);
+  } else if (!callback && !token) {
+    lst = PyList_New(chunks);
+    if (lst == NULL) {
+      Queue_scheduleRead_CLEANUP;
+      return NULL;
+    }
+    for (a = 0; a < chunks; a++) {
+      PyList_SET_ITEM(lst, a, deferreds[a]);
+      Py_INCREF(deferreds[a]);
+    }
+  }
+
+  self->busy += chunks; /* before the GIL is released, see Queue_submit */
+  int res = Queue_enqueue(self, chunks, ioq);
+  if (res < 0) {
+    self->busy -= chunks;
+    Queue_scheduleRead_CLEANUP;
+    Py_XDECREF(lst);
+    PyErr_SetFromAIOError(res);
+    return NULL;
+  }
+
+  if (callback || token)
+    Py_RETURN_NONE;
+
+  if (group)
+    return lst;
+
+  arglist = Py_BuildValue("(N)", lst);
+  if (arglist == NULL)
+    return PyErr_NoMemory();
+  dlst = PyInstance_New(DeferredList, arglist, NULL);
+  Py_DECREF(arglist);
+  return dlst; 
+}
+
+static PyObject*
+Queue_scheduleWrite(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd;
+  off_t offset;
+  PyObject *data, *defer, *callback = NULL, *token = NULL;
+  const void *src;
+  Py_ssize_t size;
+  static char *kwlist[] = {"fd", "offset", "data", "callback", "token", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iLO|OO", kwlist,
+                                   &fd, &offset, &data, &callback, &token))
+    return NULL;
+
+  if (callback == Py_None)
+    callback = NULL;
+  if (token == Py_None)
+    token = NULL;
+  if (callback && !PyCallable_Check(callback)) {
+    PyErr_SetString(PyExc_TypeError, "callback must be callable");
+    return NULL;
+  }
+  if (token && callback) {
+    PyErr_SetString(PyExc_TypeError, "token can not be combined with callback");
+    return NULL;
+  }
+
+  if (PyObject_AsReadBuffer(data, &src, &size) < 0)
+    return NULL;
+
+  if ( self->busy + 1 > self->maxIO ) {
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    return NULL;
+  } else if ( size < 1 ) {
+    PyErr_SetString(PyExc_IOError, "nothing to write");
+    return NULL;
+  }
+
+  if (callback || token) {
+    defer = callback ? callback : token;
+    Py_INCREF(defer);
+  } else {
+    defer = Queue_newDeferred(self);
+    if (defer == NULL)
+      return NULL;
+  }
+
+  /*
+   O_DIRECT needs an aligned source buffer, so the data is staged
+   in a pooled buffer. Buffers and Staging areas are aligned memory
+   nobody can change, so a page-aligned one is written from directly,
+   e.g. what a zero-copy read returned. The caller is still
+   responsible for offset and size being multiples of the device
+   block size.
+  */
+  int alignedSize = Queue_calcAlignedSize(size);
+  int borrow = (Py_TYPE(data) == &BufferType || Py_TYPE(data) == &StagingType) &&
+    (uintptr_t)src % PAGESIZE == 0;
+
+  char *buf;
+  struct iocb *io;
+
+  if (borrow)
+    buf = (char *)src;
+  else {
+    buf = Queue_getBuffer(self, alignedSize);
+    if (buf == NULL) {
+      Py_DECREF(defer);
+      return PyErr_NoMemory();
+    }
+    memcpy(buf, src, size);
+  }
+
+  io = Queue_getIocb(self);
+  if (io == NULL) {
+    if (!borrow)
+      Queue_putBuffer(self, buf);
+    Py_DECREF(defer);
+    PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+    return NULL;
+  }
+
+  asyio_prep_pwrite(io, fd, buf, size, offset, self->fd);
+  io->aio_data = (u_int64_t)defer;
+  Queue_slot(self, io)->flags = callback ? QUEUE_SLOT_CALLBACK :
+    token ? QUEUE_SLOT_TOKEN : 0;
+  if (borrow) {
+    Py_INCREF(data);
+    Queue_slot(self, io)->owner = data;
+  }
+
+  Py_INCREF(defer); /* the one returned, see Queue_scheduleRead */
+  self->busy += 1;
+  int res = Queue_enqueue(self, 1, &io);
   if (res < 0) {
+    self->busy -= 1;
+    Queue_putIocbBuffers(self, io);
+    Queue_putIocb(self, io);
+    Py_DECREF(defer);
+    Py_DECREF(defer);
     PyErr_SetFromAIOError(res);
     return NULL;
   }
 
-  PyObject *lst, *dlst, *arglist;
-  lst = PyList_New(chunks);
-  for (a = 0; a < chunks; a++) {
-    PyList_SET_ITEM(lst, a, deferreds[a]); 
-    Py_INCREF(deferreds[a]);
+  if (callback || token) {
+    Py_DECREF(defer);
+    Py_RETURN_NONE;
+  }
+  return defer;
+}
+
+static PyObject*
+Queue_scheduleReadInto(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd;
+  off_t offset;
+  Py_ssize_t start = 0, size = -1;
+  PyObject *target, *defer, *callback = NULL, *token = NULL;
+  Py_buffer view;
+  static char *kwlist[] = {"fd", "offset", "target", "targetOffset", "size", "callback", "token", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iLO|nnOO", kwlist,
+                                   &fd, &offset, &target, &start, &size, &callback, &token))
+    return NULL;
+
+  if (callback == Py_None)
+    callback = NULL;
+  if (token == Py_None)
+    token = NULL;
+  if (callback && !PyCallable_Check(callback)) {
+    PyErr_SetString(PyExc_TypeError, "callback must be callable");
+    return NULL;
+  }
+  if (token && callback) {
+    PyErr_SetString(PyExc_TypeError, "token can not be combined with callback");
+    return NULL;
+  }
+
+  if (PyObject_GetBuffer(target, &view, PyBUF_WRITABLE) < 0)
+    return NULL;
+  if (size < 0)
+    size = view.len - start;
+  if (start < 0 || size < 1 || start + size > view.len) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "targetOffset and size must lie inside target");
+    return NULL;
+  }
+
+  if ( self->busy + 1 > self->maxIO ) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    return NULL;
+  }
+
+  if (callback || token) {
+    defer = callback ? callback : token;
+    Py_INCREF(defer);
+  } else {
+    defer = Queue_newDeferred(self);
+    if (defer == NULL) {
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+  }
+
+  struct iocb *io;
+
+  io = Queue_getIocb(self);
+  if (io == NULL) {
+    PyBuffer_Release(&view);
+    Py_DECREF(defer);
+    PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+    return NULL;
+  }
+
+  /* the view is held, and target exported, until the read completes */
+  asyio_prep_pread(io, fd, (char *)view.buf + start, size, offset, self->fd);
+  io->aio_data = (u_int64_t)defer;
+  Queue_slot(self, io)->flags = QUEUE_SLOT_LAST | (callback ? QUEUE_SLOT_CALLBACK :
+    token ? QUEUE_SLOT_TOKEN : 0);
+  Queue_slot(self, io)->view = view;
+  Queue_slot(self, io)->skip = 0;
+  Queue_slot(self, io)->length = size;
+
+  Py_INCREF(defer); /* the one returned, see Queue_scheduleRead */
+  self->busy += 1;
+  int res = Queue_enqueue(self, 1, &io);
+  if (res < 0) {
+    self->busy -= 1;
+    Queue_putIocbBuffers(self, io);
+    Queue_putIocb(self, io);
+    Py_DECREF(defer);
+    Py_DECREF(defer);
+    PyErr_SetFromAIOError(res);
+    return NULL;
+  }
+
+  if (callback || token) {
+    Py_DECREF(defer);
+    Py_RETURN_NONE;
+  }
+  return defer;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+  Submit a single vectored iocb. Takes ownership of iov and of the
+  buffers it points to, whatever happens.
+*/
+static PyObject *
+Queue_scheduleVector(Queue *self, unsigned int fd, off_t offset,
+                     struct iovec *iov, unsigned int iovcnt, int write,
+                     unsigned int flags)
+{
+  PyObject *defer;
+  struct iocb *io;
+  QueueSlot *slot;
+  unsigned int i;
+
+  defer = Queue_newDeferred(self);
+
+  io = Queue_getIocb(self);
+  if (defer == NULL || io == NULL) {
+    for (i = 0; i < iovcnt; i++)
+      Queue_putBuffer(self, iov[i].iov_base);
+    free(iov);
+    if (io)
+      Queue_putIocb(self, io);
+    else if (defer) {
+      Py_DECREF(defer);
+      PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+    }
+    return NULL;
+  }
+
+  if (write)
+    asyio_prep_pwritev(io, fd, iov, iovcnt, offset, self->fd);
+  else
+    asyio_prep_preadv(io, fd, iov, iovcnt, offset, self->fd);
+  io->aio_data = (u_int64_t)defer;
+  slot = Queue_slot(self, io);
+  slot->flags = flags;
+  slot->iov = iov;
+  slot->iovcnt = iovcnt;
+
+  Py_INCREF(defer); /* the one returned, see Queue_scheduleRead */
+  self->busy += 1;
+  int res = Queue_enqueue(self, 1, &io);
+  if (res < 0) {
+    self->busy -= 1;
+    Queue_putIocbBuffers(self, io);
+    Queue_putIocb(self, io);
+    Py_DECREF(defer);
+    Py_DECREF(defer);
+    PyErr_SetFromAIOError(res);
+    return NULL;
+  }
+
+  return defer;
+}
+
+#define Queue_scheduleVector_CLEANUP { for(cup=0;cup<a;cup++)        \
+      Queue_putBuffer(self, iov[cup].iov_base);                       \
+    free(iov); Py_DECREF(seq); }
+
+static PyObject*
+Queue_scheduleReadv(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd, a, cup, count;
+  off_t offset;
+  int zeroCopy = 0;
+  long size;
+  PyObject *sizes, *seq;
+  struct iovec *iov;
+  static char *kwlist[] = {"fd", "offset", "sizes", "zeroCopy", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iLO|i", kwlist,
+                                   &fd, &offset, &sizes, &zeroCopy))
+    return NULL;
+
+  seq = PySequence_Fast(sizes, "sizes must be a sequence");
+  if (seq == NULL)
+    return NULL;
+  count = PySequence_Fast_GET_SIZE(seq);
+
+  if ( self->busy + 1 > self->maxIO ) {
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    Py_DECREF(seq);
+    return NULL;
+  } else if ( count < 1 || count > IOV_MAX ) {
+    PyErr_Format(PyExc_IOError, "number of buffers must be between 1 and %i", IOV_MAX);
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  iov = malloc(count * sizeof(struct iovec));
+  if (iov == NULL) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  for (a = 0; a < count; a++) {
+    size = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, a));
+    if (size < 1) {
+      if (!PyErr_Occurred())
+        PyErr_SetString(PyExc_IOError, "buffer size < 1");
+      Queue_scheduleVector_CLEANUP;
+      return NULL;
+    }
+    iov[a].iov_len = size;
+    iov[a].iov_base = Queue_getBuffer(self, Queue_calcAlignedSize(size));
+    if (iov[a].iov_base == NULL) {
+      Queue_scheduleVector_CLEANUP;
+      return PyErr_NoMemory();
+    }
+  }
+  Py_DECREF(seq);
+
+  return Queue_scheduleVector(self, fd, offset, iov, count, 0, QUEUE_SLOT_LAST |
+                              (zeroCopy ? QUEUE_SLOT_ZEROCOPY : 0));
+}
+
+static PyObject*
+Queue_scheduleWritev(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd, a, cup, count;
+  off_t offset;
+  PyObject *buffers, *seq;
+  struct iovec *iov;
+  const void *src;
+  Py_ssize_t size;
+  static char *kwlist[] = {"fd", "offset", "buffers", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iLO", kwlist,
+                                   &fd, &offset, &buffers))
+    return NULL;
+
+  seq = PySequence_Fast(buffers, "buffers must be a sequence");
+  if (seq == NULL)
+    return NULL;
+  count = PySequence_Fast_GET_SIZE(seq);
+
+  if ( self->busy + 1 > self->maxIO ) {
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    Py_DECREF(seq);
+    return NULL;
+  } else if ( count < 1 || count > IOV_MAX ) {
+    PyErr_Format(PyExc_IOError, "number of buffers must be between 1 and %i", IOV_MAX);
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  iov = malloc(count * sizeof(struct iovec));
+  if (iov == NULL) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  /* Stage every buffer in aligned memory, like scheduleWrite. */
+  for (a = 0; a < count; a++) {
+    if (PyObject_AsReadBuffer(PySequence_Fast_GET_ITEM(seq, a), &src, &size) < 0) {
+      Queue_scheduleVector_CLEANUP;
+      return NULL;
+    }
+    iov[a].iov_len = size;
+    iov[a].iov_base = Queue_getBuffer(self, Queue_calcAlignedSize(size));
+    if (iov[a].iov_base == NULL) {
+      Queue_scheduleVector_CLEANUP;
+      return PyErr_NoMemory();
+    }
+    memcpy(iov[a].iov_base, src, size);
+  }
+  Py_DECREF(seq);
+
+  return Queue_scheduleVector(self, fd, offset, iov, count, 1, 0);
+}
+
+static PyObject*
+Queue_scheduleFsync(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd;
+  int dataOnly = 0;
+  PyObject *defer;
+  struct iocb *io;
+  static char *kwlist[] = {"fd", "dataOnly", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|i", kwlist,
+                                   &fd, &dataOnly))
+    return NULL;
+
+  if ( self->busy + 1 > self->maxIO ) {
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    return NULL;
+  }
+
+  defer = Queue_newDeferred(self);
+  if (defer == NULL)
+    return NULL;
+
+  io = Queue_getIocb(self);
+  if (io == NULL) {
+    Py_DECREF(defer);
+    PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+    return NULL;
+  }
+  asyio_prep_fsync(io, fd, dataOnly, self->fd);
+  io->aio_data = (u_int64_t)defer;
+  Queue_slot(self, io)->flags = 0;
+
+  Py_INCREF(defer); /* the one returned, see Queue_scheduleRead */
+  self->busy += 1;
+  int res = Queue_enqueue(self, 1, &io);
+  if (res < 0) {
+    self->busy -= 1;
+    Queue_putIocb(self, io);
+    Py_DECREF(defer);
+    Py_DECREF(defer);
+    PyErr_SetFromAIOError(res);
+    return NULL;
+  }
+
+  return defer;
+}
+
+#define Queue_scheduleBarrier_CLEANUP { for(cup=0;cup<a;cup++) {   \
+      Queue_putBuffer(self, (char *)ioq[cup]->aio_buf);            \
+      Queue_slot(self, ioq[cup])->group = NULL;                     \
+      Queue_putIocb(self, ioq[cup]); }                              \
+    if (group->trailer) Queue_putIocb(self, group->trailer);        \
+    Queue_freeGroup(group); Py_XDECREF(seq); }
+
+static PyObject*
+Queue_scheduleBarrier(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int fd, a, cup, count;
+  off_t offset;
+  int dataOnly = 0;
+  PyObject *writes, *seq;
+  QueueGroup *group;
+  const void *src;
+  Py_ssize_t size;
+  char *buf;
+  static char *kwlist[] = {"fd", "writes", "dataOnly", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO|i", kwlist,
+                                   &fd, &writes, &dataOnly))
+    return NULL;
+
+  seq = PySequence_Fast(writes, "writes must be a sequence of (offset, data) pairs");
+  if (seq == NULL)
+    return NULL;
+  count = PySequence_Fast_GET_SIZE(seq);
+
+  /* count writes plus the trailing sync */
+  if ( self->busy + count + 1 > self->maxIO ) {
+    PyErr_SetString(QueueError, "can not accept new schedules - no free slots");
+    Py_DECREF(seq);
+    return NULL;
+  } else if ( count < 1 ) {
+    PyErr_SetString(PyExc_IOError, "nothing to write");
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  group = Queue_newGroup(self, 0, 0, NULL);
+  if (group == NULL) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  struct iocb *ioq[count];
+
+  a = 0;
+  group->trailer = Queue_getIocb(self);
+  if (group->trailer == NULL) {
+    PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+    Queue_scheduleBarrier_CLEANUP;
+    return NULL;
+  }
+  asyio_prep_fsync(group->trailer, fd, dataOnly, self->fd);
+  asyio_set_ioprio(group->trailer, self->ioprio);
+  Queue_slot(self, group->trailer)->flags = 0;
+
+  for (a = 0; a < count; ) {
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, a), "LO;writes must be a sequence of (offset, data) pairs", &offset, &writes) ||
+        PyObject_AsReadBuffer(writes, &src, &size) < 0) {
+      Queue_scheduleBarrier_CLEANUP;
+      return NULL;
+    }
+    buf = Queue_getBuffer(self, Queue_calcAlignedSize(size));
+    if (buf == NULL) {
+      Queue_scheduleBarrier_CLEANUP;
+      return PyErr_NoMemory();
+    }
+    memcpy(buf, src, size);
+    ioq[a] = Queue_getIocb(self);
+    if (ioq[a] == NULL) {
+      Queue_putBuffer(self, buf);
+      PyErr_SetString(QueueError, "can not accept new schedules - no free iocbs");
+      Queue_scheduleBarrier_CLEANUP;
+      return NULL;
+    }
+    asyio_prep_pwrite(ioq[a], fd, buf, size, offset, self->fd);
+    Queue_slot(self, ioq[a])->flags = 0;
+    Queue_slot(self, ioq[a])->group = group;
+    a++;
+  }
+  Py_CLEAR(seq);
+
+  /*
+   The kernel does not order iocbs submitted together, so the sync is
+   only submitted by processEvents, after the last write completed.
+   Its slot is reserved now.
+
+   The group counts this call as a member too: writes may complete in
+   another thread while the GIL is released, and the group must not
+   fire before the partial submission below is accounted for.
+  */
+  PyObject *defer = group->defer, *result;
+  int failed = 0;
+
+  Py_INCREF(defer);
+  group->pending = count + 1;
+  self->busy += count + 1;
+  int res = Queue_enqueue(self, count, ioq);
+  if (res < 0) {
+    self->busy -= count + 1;
+    Queue_scheduleBarrier_CLEANUP;
+    Py_DECREF(defer);
+    PyErr_SetFromAIOError(res);
+    return NULL;
+  }
+  /* writes the kernel refused fail the group when they complete */
+  result = PyInt_FromLong(0);
+  if (result == NULL) {
+    result = Queue_fetchError();
+    failed = 1;
+  }
+  if (Queue_groupDone(self, group, 0, result, failed) < 0) {
+    Py_DECREF(defer);
+    return NULL;
+  }
+  return defer;
+}
+
+static PyObject*
+Queue_waitForSlots(Queue *self, PyObject *args, PyObject *kwds) {
+  unsigned int slots = 1;
+  PyObject *defer, *waiter, *result;
+  static char *kwlist[] = {"slots", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &slots))
+    return NULL;
+
+  if ( slots < 1 || slots > self->maxIO ) {
+    PyErr_SetString(PyExc_IOError, "slots must be between 1 and maxIO");
+    return NULL;
+  }
+
+  defer = Queue_newDeferred(self);
+  if (defer == NULL)
+    return NULL;
+
+  /* earlier waiters go first, even if this one would fit */
+  if ((self->waiters == NULL || PyList_GET_SIZE(self->waiters) == 0) &&
+      self->busy + slots <= self->maxIO) {
+    result = PyInt_FromLong(self->maxIO - self->busy);
+    if (result == NULL) {
+      Py_DECREF(defer);
+      return NULL;
+    }
+    Py_INCREF(defer);
+    if (Queue_fire(self, defer, 0, result, 0) < 0) {
+      Py_DECREF(defer);
+      return NULL;
+    }
+    return defer;
+  }
+
+  if (self->waiters == NULL && (self->waiters = PyList_New(0)) == NULL) {
+    Py_DECREF(defer);
+    return NULL;
+  }
+  waiter = Py_BuildValue("(iO)", slots, defer);
+  if (waiter == NULL || PyList_Append(self->waiters, waiter) < 0) {
+    Py_XDECREF(waiter);
+    Py_DECREF(defer);
+    return NULL;
+  }
+  Py_DECREF(waiter);
+  return defer;
+}
+
+/*
+  Take back one iocb. A staged iocb never reaches the kernel, it
+  completes with ECANCELED on the next processEvents, like one a flush
+  could not submit. A submitted one is only asked to stop - regular
+  files usually are not - and completes through the ring as usual.
+*/
+static void
+Queue_cancelIocb(Queue *self, struct iocb *io)
+{
+  struct io_event ev;
+  unsigned int i;
+  u_int64_t count = 1;
+
+  for (i = 0; i < self->stagedCount && self->staged[i] != io; i++)
+    ;
+  if (i < self->stagedCount) {
+    memmove(self->staged + i, self->staged + i + 1,
+            (self->stagedCount - i - 1) * sizeof(struct iocb *));
+    self->stagedCount -= 1;
+    ev.obj = (u_int64_t)io;
+    ev.data = io->aio_data;
+    ev.res = -ECANCELED;
+    ev.res2 = 0;
+  } else if (self->uring) {
+    pthread_mutex_lock(&self->submitLock);
+    asyuring_cancel(self->uring, io);
+    pthread_mutex_unlock(&self->submitLock);
+    return;
+  } else if (io_cancel(*self->ctx, io, &ev) != 0)
+    return;
+  /* busy covers it, so there is room in reaped */
+  self->reaped[self->reapedCount++] = ev;
+  if (write(self->fd, &count, sizeof(count)) < 0)
+    ; /* the counter is already signalled */
+}
+
+static PyObject*
+Queue_cancel(Queue *self, PyObject *args, PyObject *kwds) {
+  PyObject *defer, *error = NULL;
+  unsigned int a, flags = 0, found = 0;
+  Py_ssize_t i;
+  static char *kwlist[] = {"defer", "error", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &defer, &error))
+    return NULL;
+
+  for (i = self->waiters ? PyList_GET_SIZE(self->waiters) : 0; i-- > 0; )
+    if (PyTuple_GET_ITEM(PyList_GET_ITEM(self->waiters, i), 1) == defer) {
+      if (PyList_SetSlice(self->waiters, i, i + 1, NULL) < 0)
+        return NULL;
+      found++;
+    }
+
+  for (a = 0; a < self->maxIO; a++) {
+    struct iocb *io = self->iocbs + a;
+    QueueSlot *slot = self->slots + a;
+
+    if ((slot->group ? slot->group->defer : (PyObject *)io->aio_data) != defer ||
+        slot->flags & QUEUE_SLOT_CANCELLED)
+      continue;
+    /* the completion still comes, only its result is dropped */
+    flags |= (slot->group ? slot->group->flags : slot->flags) &
+      (QUEUE_SLOT_CALLBACK | QUEUE_SLOT_TOKEN);
+    slot->flags |= QUEUE_SLOT_CANCELLED;
+    if (slot->group)
+      slot->group->flags |= QUEUE_SLOT_CANCELLED;
+    Queue_cancelIocb(self, io);
+    found++;
+  }
+
+  if (found && error && error != Py_None && !(flags & QUEUE_SLOT_TOKEN)) {
+    Py_INCREF(defer);
+    Py_INCREF(error);
+    if (Queue_fire(self, defer, flags, error, 1) < 0)
+      return NULL;
+  }
+  return PyInt_FromLong(found);
+}
+
+static PyObject*
+Queue_flushMethod(Queue *self) {
+  unsigned int n = self->stagedCount;
+
+  return PyInt_FromLong(n - Queue_flush(self));
+}
+
+static PyObject*
+Queue_close(Queue *self) {
+  if (self->busy) {
+    PyErr_SetString(QueueError, "can not close - operations in flight");
+    return NULL;
+  }
+  if (self->fd == -1)
+    Py_RETURN_NONE;
+
+  if (self->uring) {
+    asyuring_destroy(self->uring);
+    free(self->uring);
+    self->uring = NULL;
+  } else {
+    io_destroy(*self->ctx);
+    *self->ctx = 0;
   }
-  arglist = Py_BuildValue("(O)", lst);
-  if (arglist == NULL)
-    return PyErr_NoMemory();
-  dlst = PyInstance_New(DeferredList, arglist, NULL);
-  Py_DECREF(arglist);
-  return dlst; 
+  close(self->fd);
+  self->fd = -1;
+  /* Buffers still holding pooled memory keep the pool until dealloc */
+  if (self->pool && self->poolFreeTop == self->bufferCount) {
+    munmap(self->pool, (size_t)self->bufferCount * self->poolStride);
+    self->pool = NULL;
+    self->bufferCount = self->poolFreeTop = 0;
+  }
+  Py_RETURN_NONE;
 }
 
 static PyMemberDef Queue_members[] = {
@@ -348,6 +2075,44 @@ this object can handle. See man:io_queue_init(2) ."},
   {"fd", T_INT, offsetof(Queue, fd), 0,
    "Filedescriptor, which will receive notification events.\n\
 See: man:eventfd(2) ."},
+  {"engine", T_STRING, offsetof(Queue, engine), READONLY,
+   "Kernel interface in use: \"aio\" (io_submit and friends) or\n\
+\"uring\" (io_uring). See man:io_uring_setup(2) ."},
+  {"bufferSize", T_UINT, offsetof(Queue, bufferSize), READONLY,
+   "Largest chunk served from the pool (rounded up to the page size),\n\
+whatever its offset: pooled buffers are alignment bytes longer."},
+  {"bufferCount", T_UINT, offsetof(Queue, bufferCount), READONLY,
+   "Number of buffers in the pool."},
+  {"poolHits", T_UINT, offsetof(Queue, poolHits), READONLY,
+   "Number of buffers taken from the pool."},
+  {"poolMisses", T_UINT, offsetof(Queue, poolMisses), READONLY,
+   "Number of buffers allocated outside of the pool, because the\n\
+pool was empty or the chunk was bigger than bufferSize."},
+  {"flushThreshold", T_UINT, offsetof(Queue, flushThreshold), 0,
+   "If not 0, operations are staged and submitted together, with a\n\
+single syscall, by flush() or once this many are staged."},
+  {"flushHook", T_OBJECT, offsetof(Queue, flushHook), 0,
+   "Callable called without arguments when an operation is staged\n\
+and the staging area was empty; it should arrange for flush()\n\
+to be called soon."},
+  {"flushes", T_UINT, offsetof(Queue, flushes), READONLY,
+   "Number of flushes of the staging area."},
+  {"submitCalls", T_UINT, offsetof(Queue, submitCalls), READONLY,
+   "Number of submission syscalls made."},
+  {"submitted", T_UINT, offsetof(Queue, submitted), READONLY,
+   "Number of operations accepted by the kernel."},
+  {"alignment", T_UINT, offsetof(Queue, alignment), READONLY,
+   "Reads are widened to offsets and sizes which are multiples of\n\
+this, the logical block size O_DIRECT needs (4096 by default, which\n\
+suits both 512 byte and 4K sector drives)."},
+  {"ioprio", T_INT, offsetof(Queue, ioprio), 0,
+   "I/O priority of operations scheduled from now on, as\n\
+(class << 13) | level; 0 keeps the priority of the process.\n\
+See man:ioprio_set(2) ."},
+  {"completionHandler", T_OBJECT, offsetof(Queue, completionHandler), 0,
+   "Callable receiving the list of (token, result, data) tuples of\n\
+operations scheduled with a token, once per processEvents call.\n\
+If it is None, processEvents returns the list instead."},
   {NULL}  /* Sentinel */
 };
 
@@ -360,18 +2125,172 @@ static PyMethodDef Queue_methods[] = {
 This method actually processes events and calls callbacks \n\
 and errbacks accordingly. \n\
 \n\
-@returns: None\n\
+Operations scheduled with a token do not fire anything: they are\n\
+collected as (token, result, data) tuples - result being the number\n\
+of bytes transferred or an IOError instance, data the chunk read\n\
+(None for writes and failures) - and passed to completionHandler\n\
+with a single call.\n\
+\n\
+@returns: None, or the list of token completions if there is\n\
+no completionHandler.\n\
+See man:io_getevents(2) ."},
+
+  {"reapEvents", (PyCFunction)Queue_reapEvents, METH_VARARGS|METH_KEYWORDS,
+   "reapEvents(minEvents, maxEvents, timeoutNSec)\n\
+ -- wait for at least minEvents in timeoutNSec time, without\n\
+ holding the interpreter lock, and keep them for processEvents.\n\
+\n\
+Meant to be called in a loop by a single worker thread; the reactor\n\
+thread then calls processEvents to fire the callbacks. Once this\n\
+was called, processEvents only delivers the events collected here.\n\
+\n\
+@returns: the number of events waiting for processEvents.\n\
 See man:io_getevents(2) ."},
 
-  {"scheduleRead", (PyCFunction)Queue_scheduleRead, METH_VARARGS|METH_KEYWORDS, "scheduleRead(fd, offset, chunks, chunksSize);\n\
+  {"scheduleRead", (PyCFunction)Queue_scheduleRead, METH_VARARGS|METH_KEYWORDS, "scheduleRead(fd, offset, chunks, chunksSize, zeroCopy=False, batch=False, callback=None, token=None);\n\
  -- schedule a read operation on filedescriptor fd,\n\
  starting with offset, dividing the operation to \n\
  no. chunks, each as long as chunkSize.\n\
 \n\
+Offsets and sizes do not need to be aligned: each chunk is read\n\
+widened to multiples of alignment, and only the requested bytes\n\
+are passed on. The last chunk is shorter, or empty, if the file\n\
+ends before it; any other chunk coming back short fails with an\n\
+IOError.\n\
+\n\
+If zeroCopy is true, chunks are passed as _aio.Buffer objects\n\
+wrapping the buffer the kernel read into, instead of strings.\n\
+\n\
+If batch is true, a single Deferred is returned instead of a\n\
+DeferredList. It fires once, after the last chunk completed, with\n\
+the list of chunks in file order, or with the first error.\n\
+\n\
+If callback is given, no Deferreds are created at all: callback\n\
+is called with each chunk (or once with the list, in batch mode)\n\
+and with an IOError instance on failure, and None is returned.\n\
+\n\
+If token is given, chunks are delivered in batches by processEvents,\n\
+see completionHandler. With several chunks, token must be a sequence\n\
+holding one token per chunk. None is returned.\n\
+\n\
 @returns: twisted.internet.defer.Deferred object if only one chunk \n\
 or twisted.internet.defer.DeferredList if many chunks.\n\
 \n\
 See man:io_prep_pread(2) .\n"},
+
+  {"scheduleReadInto", (PyCFunction)Queue_scheduleReadInto, METH_VARARGS|METH_KEYWORDS, "scheduleReadInto(fd, offset, target, targetOffset=0, size=-1, callback=None, token=None);\n\
+ -- schedule reading size bytes (by default, the rest of target)\n\
+ from filedescriptor fd at offset straight into target, an object\n\
+ exporting a writable buffer, such as a Staging area or a bytearray,\n\
+ at targetOffset.\n\
+\n\
+Nothing is copied, so nothing is widened either: with O_DIRECT,\n\
+offset, size and the target memory must be aligned. The buffer of\n\
+target is held until the read completes, so it can not be resized\n\
+meanwhile. Less is read at the end of file.\n\
+callback and token are handled like in scheduleRead.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with the\n\
+number of bytes read.\n\
+\n\
+See man:io_prep_pread(2) .\n"},
+
+  {"scheduleWrite", (PyCFunction)Queue_scheduleWrite, METH_VARARGS|METH_KEYWORDS, "scheduleWrite(fd, offset, data, callback=None, token=None);\n\
+ -- schedule writing data (a string or any object supporting\n\
+ the buffer interface) to filedescriptor fd at offset.\n\
+\n\
+Data is copied to an aligned buffer first, so it can be used\n\
+with O_DIRECT descriptors as long as offset and len(data) are\n\
+multiples of the device block size. A Buffer (as returned by a\n\
+zero-copy read) or a Staging area is written from without a copy,\n\
+and referenced until the write completes.\n\
+\n\
+If callback is given, it is called with the result (or an IOError\n\
+instance) instead of firing a Deferred, and None is returned.\n\
+If token is given, the completion is delivered by processEvents\n\
+instead, see completionHandler.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with\n\
+the number of bytes written.\n\
+\n\
+See man:io_prep_pwrite(2) .\n"},
+
+  {"scheduleReadv", (PyCFunction)Queue_scheduleReadv, METH_VARARGS|METH_KEYWORDS, "scheduleReadv(fd, offset, sizes, zeroCopy=False);\n\
+ -- schedule a single vectored read on filedescriptor fd,\n\
+ scattering the range starting at offset into one buffer per\n\
+ item of sizes. Uses one slot, whatever the number of buffers.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with\n\
+a list of strings (or _aio.Buffer objects with zeroCopy). Less is\n\
+read at the end of file: the items past it are shorter, or empty.\n\
+\n\
+See man:preadv(2) .\n"},
+
+  {"scheduleWritev", (PyCFunction)Queue_scheduleWritev, METH_VARARGS|METH_KEYWORDS, "scheduleWritev(fd, offset, buffers);\n\
+ -- schedule a single vectored write, gathering all items of\n\
+ buffers into one contiguous range starting at offset.\n\
+ Uses one slot, whatever the number of buffers.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with\n\
+the number of bytes written.\n\
+\n\
+See man:pwritev(2) .\n"},
+
+  {"scheduleFsync", (PyCFunction)Queue_scheduleFsync, METH_VARARGS|METH_KEYWORDS, "scheduleFsync(fd, dataOnly=False);\n\
+ -- schedule flushing filedescriptor fd to disk, like fsync(2),\n\
+ or like fdatasync(2) if dataOnly is true.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with None.\n"},
+
+  {"scheduleBarrier", (PyCFunction)Queue_scheduleBarrier, METH_VARARGS|METH_KEYWORDS, "scheduleBarrier(fd, writes, dataOnly=False);\n\
+ -- schedule a group commit: all (offset, data) pairs from writes\n\
+ are submitted at once, followed by a fsync (or fdatasync, if\n\
+ dataOnly is true) issued when the last of them completed.\n\
+ Takes len(writes) + 1 slots.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with the\n\
+total number of bytes written once the data is on disk, or with\n\
+the first error.\n"},
+
+  {"flush", (PyCFunction)Queue_flushMethod, METH_NOARGS,
+   "flush()\n\
+ -- submit all staged operations with a single syscall.\n\
+\n\
+Operations the kernel refuses fail with an IOError, delivered by\n\
+the next processEvents call.\n\
+\n\
+@returns: the number of operations submitted.\n"},
+
+  {"waitForSlots", (PyCFunction)Queue_waitForSlots, METH_VARARGS|METH_KEYWORDS, "waitForSlots(slots=1);\n\
+ -- wait until at least slots operations can be scheduled.\n\
+\n\
+Waiters are fired in order from processEvents, as soon as the\n\
+completed operations freed enough slots, so the queue can be\n\
+refilled without polling.\n\
+\n\
+@returns: twisted.internet.defer.Deferred object, fired with the\n\
+number of free slots.\n"},
+  {"close", (PyCFunction)Queue_close, METH_NOARGS,
+   "close()\n\
+ -- give the kernel context, the notification fd and the buffer\n\
+ pool back, instead of waiting for the Queue to be collected.\n\
+\n\
+Only an idle queue can be closed; nothing can be scheduled on it\n\
+afterwards. The pool is kept while Buffers still use it.\n\
+\n\
+See man:io_destroy(2) .\n"},
+  {"cancel", (PyCFunction)Queue_cancel, METH_VARARGS|METH_KEYWORDS, "cancel(defer, error=None);\n\
+ -- cancel the operations defer stands for.\n\
+\n\
+defer is what a schedule method or waitForSlots returned, or the\n\
+callback or token it was given. Staged operations never reach the\n\
+kernel; submitted ones are cancelled if the kernel can, otherwise\n\
+they keep their slot until they complete and the result is dropped.\n\
+If error is given, defer is errback'ed with it. Deferreds created\n\
+by the Queue call this from their cancel().\n\
+\n\
+@returns: number of operations (or waiters) cancelled.\n\
+See man:io_cancel(2) .\n"},
   {NULL, NULL, 0, NULL}
 };
 
@@ -396,10 +2315,26 @@ static PyTypeObject QueueType = {
   0,                         /*tp_getattro*/
   0,                         /*tp_setattro*/
   0,                         /*tp_as_buffer*/
-  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
-  "Queue objects",           /* tp_doc */
-  0,                         /* tp_traverse */
-  0,                         /* tp_clear */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+  "Queue(maxIO=32, bufferSize=65536, bufferCount=maxIO, engine='aio',\n\
+      flushThreshold=0, alignment=4096)\n\
+ -- Queue objects.\n\
+\n\
+maxIO is the number of operations in flight at a time.\n\
+\n\
+Read buffers are taken from a pool of bufferCount page-aligned\n\
+buffers, bufferSize bytes each, allocated with one mmap call.\n\
+\n\
+engine is 'aio' for KAIO, or 'uring' for io_uring where the kernel\n\
+supports it; KAIO is used otherwise, see the engine attribute.\n\
+\n\
+If flushThreshold is not 0, operations are staged and submitted\n\
+together, see flush().\n\
+\n\
+Reads are widened to multiples of alignment, the logical block\n\
+size O_DIRECT descriptors need.",  /* tp_doc */
+  (traverseproc)Queue_traverse, /* tp_traverse */
+  (inquiry)Queue_clear,      /* tp_clear */
   0,                         /* tp_richcompare */
   0,                         /* tp_weaklistoffset */
   0,                         /* tp_iter */
@@ -421,7 +2356,399 @@ static PyTypeObject QueueType = {
 /* ============================== END OF _aio.Queue ======================================== */
 
 
+/* ================================================================================
+
+  _aio.Buffer
+
+   Read-only view of a buffer owned by a Queue. It exposes the memory
+   the kernel read into through the buffer protocol and returns it to
+   the Queue's pool when the object is released.
+
+   ================================================================================ */
+
+typedef struct {
+  PyObject_HEAD
+
+  Queue *queue; /* owner of base */
+  char *base; /* what Queue_getBuffer returned */
+  char *data; /* start of valid data, somewhere inside base */
+  Py_ssize_t size;
+
+} Buffer;
+
+static PyTypeObject BufferType;
+
+static PyObject *
+Buffer_create(Queue *queue, char *base, char *data, Py_ssize_t size)
+{
+  Buffer *self;
+
+  self = PyObject_New(Buffer, &BufferType);
+  if (self == NULL) {
+    Queue_putBuffer(queue, base);
+    return NULL;
+  }
+  Py_INCREF(queue);
+  self->queue = queue;
+  self->base = base;
+  self->data = data;
+  self->size = size;
+  return (PyObject *)self;
+}
+
+static void
+Buffer_dealloc(Buffer *self)
+{
+  Queue_putBuffer(self->queue, self->base);
+  Py_DECREF(self->queue);
+  PyObject_Del(self);
+}
+
+static Py_ssize_t
+Buffer_length(Buffer *self)
+{
+  return self->size;
+}
+
+static PyObject *
+Buffer_str(Buffer *self)
+{
+  return PyString_FromStringAndSize(self->data, self->size);
+}
+
+static Py_ssize_t
+Buffer_getreadbuf(Buffer *self, Py_ssize_t segment, void **ptr)
+{
+  if (segment != 0) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent buffer segment");
+    return -1;
+  }
+  *ptr = self->data;
+  return self->size;
+}
+
+static Py_ssize_t
+Buffer_getsegcount(Buffer *self, Py_ssize_t *lenp)
+{
+  if (lenp)
+    *lenp = self->size;
+  return 1;
+}
+
+static int
+Buffer_getbuffer(Buffer *self, Py_buffer *view, int flags)
+{
+  return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->size, 1, flags);
+}
+
+static PySequenceMethods Buffer_as_sequence = {
+  (lenfunc)Buffer_length,    /* sq_length */
+};
+
+static PyBufferProcs Buffer_as_buffer = {
+  (readbufferproc)Buffer_getreadbuf,  /* bf_getreadbuffer */
+  0,                                  /* bf_getwritebuffer */
+  (segcountproc)Buffer_getsegcount,   /* bf_getsegcount */
+  (charbufferproc)Buffer_getreadbuf,  /* bf_getcharbuffer */
+  (getbufferproc)Buffer_getbuffer,    /* bf_getbuffer */
+  0,                                  /* bf_releasebuffer */
+};
+
+static PyTypeObject BufferType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "_aio.Buffer",             /*tp_name*/
+  sizeof(Buffer),            /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)Buffer_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  &Buffer_as_sequence,       /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  (reprfunc)Buffer_str,      /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  &Buffer_as_buffer,         /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+  "Buffer objects\n\
+\n\
+Data read by Queue.scheduleRead(..., zeroCopy=True). Use buffer(),\n\
+memoryview() or str() to access it; the memory goes back to the\n\
+Queue buffer pool once the object and all views are released.", /* tp_doc */
+};
+
+
+/* ============================== END OF _aio.Buffer ======================================== */
+
+
+/* ================================================================================
+
+  _aio.Staging
+
+   Shared memory area (a memfd, or an unlinked file in /dev/shm on
+   older kernels) mapped into the process. The Queue reads into it
+   with scheduleReadInto, and sendfile() moves it to a socket from
+   the file descriptor, so the data never becomes a Python string.
+
+   ================================================================================ */
+
+typedef struct {
+  PyObject_HEAD
+
+  /* public */
+  int fd; /* the shared memory file */
+  Py_ssize_t size;
+
+  /* private */
+  char *base; /* the mapping */
+
+} Staging;
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static int
+Staging_open(void)
+{
+  char name[] = "/dev/shm/_aio.XXXXXX";
+  int fd;
+
+#ifdef __NR_memfd_create
+  fd = syscall(__NR_memfd_create, "_aio.Staging", MFD_CLOEXEC);
+  if (fd >= 0 || errno != ENOSYS)
+    return fd;
+#endif
+  fd = mkstemp(name);
+  if (fd >= 0)
+    unlink(name);
+  return fd;
+}
+
+static int
+Staging_init(Staging *self, PyObject *args, PyObject *kwds)
+{
+  Py_ssize_t size;
+  static char *kwlist[] = {"size", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &size))
+    return -1;
+
+  if (size < 1) {
+    PyErr_SetString(PyExc_ValueError, "size must be positive");
+    return -1;
+  }
+  if (self->base != NULL) {
+    PyErr_SetString(PyExc_TypeError, "Staging is already initialised");
+    return -1;
+  }
+
+  self->size = Queue_calcAlignedSize(size);
+  self->fd = Staging_open();
+  if (self->fd < 0 || ftruncate(self->fd, self->size) < 0) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  self->base = mmap(NULL, self->size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+  if (self->base == MAP_FAILED) {
+    self->base = NULL;
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *
+Staging_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  Staging *self;
+
+  self = (Staging *)type->tp_alloc(type, 0);
+  if (self != NULL)
+    self->fd = -1;
+  return (PyObject *)self;
+}
+
+static void
+Staging_dealloc(Staging *self)
+{
+  if (self->base)
+    munmap(self->base, self->size);
+  if (self->fd != -1)
+    close(self->fd);
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject*
+Staging_discard(Staging *self, PyObject *args, PyObject *kwds) {
+  Py_ssize_t offset, size, end;
+  static char *kwlist[] = {"offset", "size", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "nn", kwlist, &offset, &size))
+    return NULL;
+
+  if (offset < 0 || size < 0 || offset + size > self->size) {
+    PyErr_SetString(PyExc_ValueError, "offset and size must lie inside the area");
+    return NULL;
+  }
+  /* partial pages would be zeroed in place, so they are kept */
+  end = (offset + size) - (offset + size) % PAGESIZE;
+  offset = Queue_calcAlignedSize(offset);
+  if (end > offset &&
+      fallocate(self->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, end - offset) < 0)
+    return PyErr_SetFromErrno(PyExc_IOError);
+  Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+Staging_length(Staging *self)
+{
+  return self->base ? self->size : 0;
+}
+
+static Py_ssize_t
+Staging_getbuf(Staging *self, Py_ssize_t segment, void **ptr)
+{
+  if (segment != 0) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent buffer segment");
+    return -1;
+  }
+  *ptr = self->base;
+  return Staging_length(self);
+}
+
+static Py_ssize_t
+Staging_getsegcount(Staging *self, Py_ssize_t *lenp)
+{
+  if (lenp)
+    *lenp = Staging_length(self);
+  return 1;
+}
+
+static int
+Staging_getbuffer(Staging *self, Py_buffer *view, int flags)
+{
+  return PyBuffer_FillInfo(view, (PyObject *)self, self->base, Staging_length(self), 0, flags);
+}
+
+static PyMethodDef Staging_methods[] = {
+  {"discard", (PyCFunction)Staging_discard, METH_VARARGS|METH_KEYWORDS, "discard(offset, size);\n\
+ -- drop the pages lying entirely within size bytes at offset.\n\
+\n\
+sendfile() to a TCP socket may still reference the pages it sent\n\
+after it returned. Discarding them before the area is reused makes\n\
+the next read fault in fresh pages instead of overwriting those.\n\
+\n\
+See man:fallocate(2) .\n"},
+  {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Staging_members[] = {
+  {"fd", T_INT, offsetof(Staging, fd), READONLY,
+   "Filedescriptor of the area, to be passed to sendfile()."},
+  {"size", T_PYSSIZET, offsetof(Staging, size), READONLY,
+   "Size of the area (rounded up to the page size)."},
+  {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods Staging_as_sequence = {
+  (lenfunc)Staging_length,   /* sq_length */
+};
+
+static PyBufferProcs Staging_as_buffer = {
+  (readbufferproc)Staging_getbuf,     /* bf_getreadbuffer */
+  (writebufferproc)Staging_getbuf,    /* bf_getwritebuffer */
+  (segcountproc)Staging_getsegcount,  /* bf_getsegcount */
+  (charbufferproc)Staging_getbuf,     /* bf_getcharbuffer */
+  (getbufferproc)Staging_getbuffer,   /* bf_getbuffer */
+  0,                                  /* bf_releasebuffer */
+};
+
+static PyTypeObject StagingType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "_aio.Staging",            /*tp_name*/
+  sizeof(Staging),           /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)Staging_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  &Staging_as_sequence,      /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  &Staging_as_buffer,        /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+  "Staging objects\n\
+\n\
+Staging(size) -- shared memory area of (at least) size bytes, for\n\
+Queue.scheduleReadInto and sendfile().", /* tp_doc */
+  0,		               /* tp_traverse */
+  0,		               /* tp_clear */
+  0,		               /* tp_richcompare */
+  0,		               /* tp_weaklistoffset */
+  0,		               /* tp_iter */
+  0,		               /* tp_iternext */
+  Staging_methods,           /* tp_methods */
+  Staging_members,           /* tp_members */
+  0,                         /* tp_getset */
+  0,                         /* tp_base */
+  0,                         /* tp_dict */
+  0,                         /* tp_descr_get */
+  0,                         /* tp_descr_set */
+  0,                         /* tp_dictoffset */
+  (initproc)Staging_init,    /* tp_init */
+  0,                         /* tp_alloc */
+  Staging_new,               /* tp_new */
+};
+
+/* ============================== END OF _aio.Staging ======================================== */
+
+
+static PyObject *
+module_sendfile(PyObject *module, PyObject *args, PyObject *kwds)
+{
+  int outFd, inFd;
+  off_t offset;
+  Py_ssize_t count, res;
+  static char *kwlist[] = {"outFd", "inFd", "offset", "count", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iiLn", kwlist, &outFd, &inFd, &offset, &count))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  res = sendfile(outFd, inFd, &offset, count);
+  Py_END_ALLOW_THREADS
+  if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    res = 0;
+  if (res < 0)
+    return PyErr_SetFromErrno(PyExc_IOError);
+  return PyInt_FromSsize_t(res);
+}
+
+
 static PyMethodDef module_methods[] = {
+  {"sendfile", (PyCFunction)module_sendfile, METH_VARARGS|METH_KEYWORDS, "sendfile(outFd, inFd, offset, count);\n\
+ -- copy up to count bytes from inFd at offset to outFd, within\n\
+ the kernel.\n\
+\n\
+@returns: the number of bytes copied; 0 if outFd is a non-blocking\n\
+socket which can not take more now.\n\
+\n\
+See man:sendfile(2) .\n"},
   {NULL}  /* Sentinel */
 };
 
@@ -435,10 +2762,17 @@ init_aio(void)
   PyObject* m;
 
   PAGESIZE = sysconf(_SC_PAGESIZE);
+  uringAvailable = asyuring_available();
 
   if (PyType_Ready(&QueueType) < 0)
     return;
 
+  if (PyType_Ready(&BufferType) < 0)
+    return;
+
+  if (PyType_Ready(&StagingType) < 0)
+    return;
+
   m = Py_InitModule3("_aio", module_methods, "libaio wrapper.");
   if (m == NULL)
     return;
@@ -446,6 +2780,16 @@ init_aio(void)
   Py_INCREF(&QueueType);
   PyModule_AddObject(m, "Queue", (PyObject *)&QueueType);
 
+  Py_INCREF(&BufferType);
+  PyModule_AddObject(m, "Buffer", (PyObject *)&BufferType);
+
+  Py_INCREF(&StagingType);
+  PyModule_AddObject(m, "Staging", (PyObject *)&StagingType);
+
+  PyModule_AddObject(m, "engines", uringAvailable ?
+                     Py_BuildValue("(ss)", "aio", "uring") :
+                     Py_BuildValue("(s)", "aio"));
+
   QueueError = PyErr_NewException("_aio.QueueError", NULL, NULL);
   Py_INCREF(QueueError);
   PyModule_AddObject(m, "QueueError", QueueError);
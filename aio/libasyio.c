@@ -23,7 +23,9 @@
  *
  */
 
-#define _GNU_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/signal.h>
@@ -64,6 +66,7 @@ enum {
 #endif
 
 #define IOCB_FLAG_RESFD		(1 << 0)
+#define IOCB_FLAG_IOPRIO	(1 << 1)	/* aio_reqprio is an ioprio value */
 
 /*
  * we always use a 64bit off_t when communicating
@@ -102,6 +105,27 @@ struct io_event {
   int64_t 		res2;           /* secondary result */
 };
 
+/*
+ * Completion ring the kernel maps at the address io_setup returns
+ * as the aio_context_t. See fs/aio.c .
+ */
+#define AIO_RING_MAGIC			0xa10a10a1
+#define AIO_RING_INCOMPAT_FEATURES	0
+
+struct aio_ring {
+  unsigned	id;	/* kernel internal index number */
+  unsigned	nr;	/* number of io_events */
+  unsigned	head;	/* written by userland or by the kernel */
+  unsigned	tail;
+
+  unsigned	magic;
+  unsigned	compat_features;
+  unsigned	incompat_features;
+  unsigned	header_length;	/* size of aio_ring */
+
+  struct io_event io_events[0];
+};
+
 inline void asyio_prep_pread(struct iocb *iocb, int fd, void *buf, int nr_segs,
 		      int64_t offset, int afd) {
   memset(iocb, 0, sizeof(*iocb));
@@ -128,25 +152,98 @@ inline void asyio_prep_pwrite(struct iocb *iocb, int fd, void const *buf, int nr
   iocb->aio_resfd = afd;
 }
 
+inline void asyio_prep_preadv(struct iocb *iocb, int fd, struct iovec const *iov,
+		       int nr_segs, int64_t offset, int afd) {
+  memset(iocb, 0, sizeof(*iocb));
+  iocb->aio_fildes = fd;
+  iocb->aio_lio_opcode = IOCB_CMD_PREADV;
+  iocb->aio_reqprio = 0;
+  iocb->aio_buf = (u_int64_t) iov;
+  iocb->aio_nbytes = nr_segs;
+  iocb->aio_offset = offset;
+  iocb->aio_flags = IOCB_FLAG_RESFD;
+  iocb->aio_resfd = afd;
+}
+
+inline void asyio_prep_pwritev(struct iocb *iocb, int fd, struct iovec const *iov,
+			int nr_segs, int64_t offset, int afd) {
+  memset(iocb, 0, sizeof(*iocb));
+  iocb->aio_fildes = fd;
+  iocb->aio_lio_opcode = IOCB_CMD_PWRITEV;
+  iocb->aio_reqprio = 0;
+  iocb->aio_buf = (u_int64_t) iov;
+  iocb->aio_nbytes = nr_segs;
+  iocb->aio_offset = offset;
+  iocb->aio_flags = IOCB_FLAG_RESFD;
+  iocb->aio_resfd = afd;
+}
+
+inline void asyio_prep_fsync(struct iocb *iocb, int fd, int datasync, int afd) {
+  memset(iocb, 0, sizeof(*iocb));
+  iocb->aio_fildes = fd;
+  iocb->aio_lio_opcode = datasync ? IOCB_CMD_FDSYNC : IOCB_CMD_FSYNC;
+  iocb->aio_reqprio = 0;
+  iocb->aio_flags = IOCB_FLAG_RESFD;
+  iocb->aio_resfd = afd;
+}
+
+/*
+ * The io_* wrappers return -errno on failure, like the kernel does,
+ * so callers can pass the result to PyErr_SetFromAIOError.
+ */
+inline long io_syscall_result(long res) {
+  return res < 0 ? -errno : res;
+}
+
 inline long io_setup(unsigned nr_reqs, aio_context_t *ctx) {
-  return syscall(__NR_io_setup, nr_reqs, ctx);
+  return io_syscall_result(syscall(__NR_io_setup, nr_reqs, ctx));
 }
 
 inline long io_destroy(aio_context_t ctx) {
-  return syscall(__NR_io_destroy, ctx);
+  return io_syscall_result(syscall(__NR_io_destroy, ctx));
 }
 
 inline long io_submit(aio_context_t ctx, long n, struct iocb **paiocb) {
-  return syscall(__NR_io_submit, ctx, n, paiocb);
+  return io_syscall_result(syscall(__NR_io_submit, ctx, n, paiocb));
 }
 
 inline long io_cancel(aio_context_t ctx, struct iocb *aiocb, struct io_event *res) {
-  return syscall(__NR_io_cancel, ctx, aiocb, res);
+  return io_syscall_result(syscall(__NR_io_cancel, ctx, aiocb, res));
 }
 
 inline long io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events,
 		  struct timespec *tmo) {
-  return syscall(__NR_io_getevents, ctx, min_nr, nr, events, tmo);
+  return io_syscall_result(syscall(__NR_io_getevents, ctx, min_nr, nr, events, tmo));
+}
+
+/*
+ * Take up to nr completions straight from the mapped ring, without
+ * entering the kernel. Returns -1 if the ring layout is not the one
+ * we know, the caller has to use io_getevents then.
+ */
+inline long io_reap_ring(aio_context_t ctx, long nr, struct io_event *events) {
+  struct aio_ring *ring = (struct aio_ring *)ctx;
+  unsigned head, tail;
+  long n = 0;
+
+  if (ring == NULL || ring->magic != AIO_RING_MAGIC ||
+      ring->incompat_features != AIO_RING_INCOMPAT_FEATURES)
+    return -1;
+
+  head = ring->head;
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); /* events before tail are complete */
+  while (head != tail && n < nr) {
+    events[n++] = ring->io_events[head];
+    head = (head + 1) % ring->nr;
+  }
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE); /* the kernel may reuse them now */
+  return n;
+}
+
+inline void asyio_set_ioprio(struct iocb *iocb, int ioprio) {
+  iocb->aio_reqprio = ioprio;
+  if (ioprio)
+    iocb->aio_flags |= IOCB_FLAG_IOPRIO;
 }
 
 inline void io_set_callback(struct iocb *iocb, u_int64_t cb) {
@@ -0,0 +1,385 @@
+/*
+
+  libasyuring - io_uring engine for libasyio users.
+
+  See LICENSE for details.
+
+*/
+
+/*
+ * Drives an io_uring instance with the iocbs libasyio users already
+ * build: every iocb is translated to a SQE when submitted, and every
+ * CQE back to an io_event when reaped, so callers only have to swap
+ * io_submit/io_getevents for asyuring_submit/asyuring_getevents.
+ *
+ * Include after libasyio.c. No liburing needed, the kernel ABI is
+ * declared below, like libasyio does for KAIO.
+ */
+
+#include <sys/mman.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register	427
+#endif
+
+enum {
+  ASYURING_OP_NOP = 0,
+  ASYURING_OP_READV = 1,
+  ASYURING_OP_WRITEV = 2,
+  ASYURING_OP_FSYNC = 3,
+  ASYURING_OP_ASYNC_CANCEL = 14,
+  ASYURING_OP_READ = 22,
+  ASYURING_OP_WRITE = 23,
+};
+
+#define ASYURING_SETUP_CLAMP		(1U << 4)
+#define ASYURING_FEAT_SINGLE_MMAP	(1U << 0)
+#define ASYURING_FEAT_EXT_ARG		(1U << 8)
+#define ASYURING_ENTER_GETEVENTS	(1U << 0)
+#define ASYURING_ENTER_EXT_ARG		(1U << 3)
+#define ASYURING_REGISTER_EVENTFD	4
+#define ASYURING_REGISTER_PROBE		8
+#define ASYURING_FSYNC_DATASYNC		(1U << 0)
+#define ASYURING_OP_SUPPORTED		(1U << 0)
+
+#define ASYURING_OFF_SQ_RING		0ULL
+#define ASYURING_OFF_CQ_RING		0x8000000ULL
+#define ASYURING_OFF_SQES		0x10000000ULL
+
+struct asyuring_sqring_offsets {
+  u_int32_t head, tail, ring_mask, ring_entries, flags, dropped, array, resv1;
+  u_int64_t user_addr;
+};
+
+struct asyuring_cqring_offsets {
+  u_int32_t head, tail, ring_mask, ring_entries, overflow, cqes, flags, resv1;
+  u_int64_t user_addr;
+};
+
+struct asyuring_params {
+  u_int32_t sq_entries, cq_entries, flags, sq_thread_cpu, sq_thread_idle;
+  u_int32_t features, wq_fd, resv[3];
+  struct asyuring_sqring_offsets sq_off;
+  struct asyuring_cqring_offsets cq_off;
+};
+
+struct asyuring_sqe {
+  u_int8_t	opcode;
+  u_int8_t	flags;
+  u_int16_t	ioprio;
+  int32_t	fd;
+  u_int64_t	off;
+  u_int64_t	addr;
+  u_int32_t	len;
+  u_int32_t	rw_flags;	/* fsync_flags for ASYURING_OP_FSYNC */
+  u_int64_t	user_data;
+  u_int16_t	buf_index;
+  u_int16_t	personality;
+  int32_t	splice_fd_in;
+  u_int64_t	pad[2];
+}; /* 64 bytes */
+
+struct asyuring_cqe {
+  u_int64_t	user_data;
+  int32_t	res;
+  u_int32_t	flags;
+};
+
+struct asyuring_probe_op {
+  u_int8_t op, resv;
+  u_int16_t flags;
+  u_int32_t resv2;
+};
+
+struct asyuring_probe {
+  u_int8_t last_op, ops_len;
+  u_int16_t resv;
+  u_int32_t resv2[3];
+  struct asyuring_probe_op ops[256];
+};
+
+struct asyuring_timespec {
+  int64_t tv_sec;
+  long long tv_nsec;
+};
+
+struct asyuring_getevents_arg {
+  u_int64_t sigmask;
+  u_int32_t sigmask_sz, pad;
+  u_int64_t ts;
+};
+
+struct asyuring {
+  int fd;
+  u_int32_t features;
+
+  u_int32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+  u_int32_t sq_entries;
+  struct asyuring_sqe *sqes;
+
+  u_int32_t *cq_head, *cq_tail, *cq_mask;
+  struct asyuring_cqe *cqes;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+inline long io_uring_setup(unsigned entries, struct asyuring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline long io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+inline long io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void asyuring_destroy(struct asyuring *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_len);
+  if (ring->sq_ptr)
+    munmap(ring->sq_ptr, ring->sq_len);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/*
+ * Every opcode a translated iocb may need has to be there, otherwise
+ * the ring is no use to us.
+ */
+static int asyuring_check_ops(int fd) {
+  static const u_int8_t needed[] = { ASYURING_OP_READV, ASYURING_OP_WRITEV,
+				     ASYURING_OP_FSYNC, ASYURING_OP_READ,
+				     ASYURING_OP_WRITE };
+  struct asyuring_probe probe;
+  unsigned int i;
+
+  memset(&probe, 0, sizeof(probe));
+  if (io_uring_register(fd, ASYURING_REGISTER_PROBE, &probe, 256) < 0)
+    return -errno;
+  for (i = 0; i < sizeof(needed); i++)
+    if (needed[i] > probe.last_op || !(probe.ops[needed[i]].flags & ASYURING_OP_SUPPORTED))
+      return -EOPNOTSUPP;
+  return 0;
+}
+
+/*
+ * Set up a ring for entries requests, completions being signalled
+ * on eventfd afd. Returns 0 or -errno.
+ */
+int asyuring_setup(struct asyuring *ring, unsigned entries, int afd) {
+  struct asyuring_params p;
+  int res;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+  p.flags = ASYURING_SETUP_CLAMP;
+  ring->fd = io_uring_setup(entries, &p);
+  if (ring->fd < 0)
+    return -errno;
+  ring->features = p.features;
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(u_int32_t);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct asyuring_cqe);
+  if (p.features & ASYURING_FEAT_SINGLE_MMAP && ring->cq_len > ring->sq_len)
+    ring->sq_len = ring->cq_len;
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, ASYURING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    goto fail;
+  }
+  if (p.features & ASYURING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, ASYURING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct asyuring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, ASYURING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  ring->sq_head = (u_int32_t *)((char *)ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (u_int32_t *)((char *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (u_int32_t *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (u_int32_t *)((char *)ring->sq_ptr + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (u_int32_t *)((char *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (u_int32_t *)((char *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (u_int32_t *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct asyuring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+  if ((res = asyuring_check_ops(ring->fd)) < 0) {
+    asyuring_destroy(ring);
+    return res;
+  }
+  if (io_uring_register(ring->fd, ASYURING_REGISTER_EVENTFD, &afd, 1) < 0)
+    goto fail;
+  return 0;
+
+ fail:
+  res = -errno;
+  asyuring_destroy(ring);
+  return res;
+}
+
+/* Can this kernel run an io_uring ring we are able to use? */
+int asyuring_available(void) {
+  struct asyuring ring;
+  int afd, res;
+
+  afd = eventfd(0);
+  if (afd < 0)
+    return 0;
+  res = asyuring_setup(&ring, 1, afd);
+  if (res == 0)
+    asyuring_destroy(&ring);
+  close(afd);
+  return res == 0;
+}
+
+static void asyuring_prep_iocb(struct asyuring_sqe *sqe, struct iocb *iocb) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = iocb->aio_fildes;
+  sqe->ioprio = iocb->aio_reqprio;
+  sqe->off = iocb->aio_offset;
+  sqe->addr = iocb->aio_buf;
+  sqe->len = iocb->aio_nbytes;
+  sqe->user_data = (u_int64_t)iocb;
+  switch (iocb->aio_lio_opcode) {
+  case IOCB_CMD_PREAD: sqe->opcode = ASYURING_OP_READ; break;
+  case IOCB_CMD_PWRITE: sqe->opcode = ASYURING_OP_WRITE; break;
+  case IOCB_CMD_PREADV: sqe->opcode = ASYURING_OP_READV; break;
+  case IOCB_CMD_PWRITEV: sqe->opcode = ASYURING_OP_WRITEV; break;
+  case IOCB_CMD_FDSYNC: sqe->rw_flags = ASYURING_FSYNC_DATASYNC; /* fall through */
+  case IOCB_CMD_FSYNC:
+    sqe->opcode = ASYURING_OP_FSYNC;
+    sqe->addr = sqe->len = sqe->off = 0;
+    sqe->ioprio = 0; /* only reads and writes take one */
+    break;
+  default: sqe->opcode = ASYURING_OP_NOP;
+  }
+}
+
+/*
+ * Like io_submit: queue n iocbs and enter the kernel once. Entries
+ * the kernel did not consume are taken back, so the caller still
+ * owns them. Returns the number submitted or -errno.
+ */
+long asyuring_submit(struct asyuring *ring, long n, struct iocb **paiocb) {
+  u_int32_t tail, mask = *ring->sq_mask;
+  long i, res;
+
+  tail = *ring->sq_tail;
+  if (n > ring->sq_entries - (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)))
+    return -EAGAIN;
+  for (i = 0; i < n; i++) {
+    asyuring_prep_iocb(&ring->sqes[(tail + i) & mask], paiocb[i]);
+    ring->sq_array[(tail + i) & mask] = (tail + i) & mask;
+  }
+  __atomic_store_n(ring->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+  res = io_uring_enter(ring->fd, n, 0, 0, NULL, 0);
+  if (res < 0)
+    res = -errno;
+  if (res < n) /* no SQ polling thread, so nobody else looks at them */
+    __atomic_store_n(ring->sq_tail, tail + (res < 0 ? 0 : res), __ATOMIC_RELEASE);
+  return res;
+}
+
+/*
+ * Like io_cancel, except that the outcome is not waited for: the
+ * iocb completes through the ring either way, with -ECANCELED if it
+ * was stopped. The cancel request itself completes with user_data 0.
+ */
+long asyuring_cancel(struct asyuring *ring, struct iocb *iocb) {
+  u_int32_t tail = *ring->sq_tail, mask = *ring->sq_mask;
+  struct asyuring_sqe *sqe;
+  long res;
+
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    return -EAGAIN;
+  sqe = &ring->sqes[tail & mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = ASYURING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (u_int64_t)iocb;
+  ring->sq_array[tail & mask] = tail & mask;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  res = io_uring_enter(ring->fd, 1, 0, 0, NULL, 0);
+  if (res < 0)
+    res = -errno;
+  if (res < 1)
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  return res;
+}
+
+/* Move up to nr completions to events, as io_getevents would. */
+static long asyuring_reap(struct asyuring *ring, long nr, struct io_event *events) {
+  u_int32_t head, tail, mask = *ring->cq_mask;
+  struct asyuring_cqe *cqe;
+  long n = 0;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail && n < nr) {
+    cqe = &ring->cqes[head++ & mask];
+    if (cqe->user_data == 0) /* an asyuring_cancel request */
+      continue;
+    events[n].obj = cqe->user_data;
+    events[n].data = ((struct iocb *)cqe->user_data)->aio_data;
+    events[n].res = cqe->res;
+    events[n].res2 = 0;
+    n++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/*
+ * Like io_getevents: wait up to tmo for at least min_nr completions.
+ * Kernels without timed waits only return what is already there.
+ */
+long asyuring_getevents(struct asyuring *ring, long min_nr, long nr,
+			struct io_event *events, struct timespec *tmo) {
+  struct asyuring_timespec ts;
+  struct asyuring_getevents_arg arg;
+  long n, res;
+
+  n = asyuring_reap(ring, nr, events);
+  if (n >= min_nr || !(ring->features & ASYURING_FEAT_EXT_ARG))
+    return n;
+
+  memset(&arg, 0, sizeof(arg));
+  ts.tv_sec = tmo->tv_sec;
+  ts.tv_nsec = tmo->tv_nsec;
+  arg.ts = (u_int64_t)&ts;
+  res = io_uring_enter(ring->fd, 0, min_nr - n, ASYURING_ENTER_GETEVENTS | ASYURING_ENTER_EXT_ARG,
+		       &arg, sizeof(arg));
+  if (res < 0 && errno != ETIME && errno != EINTR)
+    return n ? n : -errno;
+  return n + asyuring_reap(ring, nr - n, events + n);
+}
@@ -3,11 +3,23 @@ from twisted.python.failure import Failure
 from twisted.trial import unittest
 from twisted.internet import reactor, task
 from twisted.internet.threads import deferToThread
-from twisted.internet.defer import Deferred
+from twisted.internet.defer import Deferred, DeferredList
 from twisted.python import threadable
 
 TEST_FILENAME = "__test_aio_output__"
 
+class StubConsumer:
+    """ consumer collecting what a producer writes to it """
+    def __init__(self):
+        self.written = []
+        self.producer = None
+    def registerProducer(self, producer, streaming):
+        self.producer = producer
+    def unregisterProducer(self):
+        self.producer = None
+    def write(self, data):
+        self.written.append(data)
+
 class TestAio(unittest.TestCase):
 
     def setUp(self):
@@ -29,6 +41,16 @@ class TestAio(unittest.TestCase):
         self.assertRaises(IOError, q.scheduleRead, 0, 0, 0, 4096)
         self.assertRaises(IOError, q.scheduleRead, -1, 0, 1, 4096)
 
+        # cancelled staged iocbs wait in processEvents' own buffer
+        q = aio.Queue(flushThreshold = 8)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        callback = lambda data: None
+        q.scheduleRead(fd, 0, 1, 512, callback = callback)
+        q.cancel(callback, IOError())
+        self.assertRaises(IOError, q.processEvents, -1, -1, -1)
+        os.close(fd)
+        q.stop()
+
     def test_badSchedule(self, *args, **kw):
         return
         import aio
@@ -51,15 +73,11 @@ class TestAio(unittest.TestCase):
         
     def test_dataError(self, *args, **kw):
         import aio
-        # read more data than available
+        # read more data than available; the read stops at the end of file
         q = aio.Queue(1)
         fd = os.open(TEST_FILENAME, os.O_DIRECT)
         def _defaultCallback(results):
-            for res in results:
-                if not res[0] and isinstance(res[1], Failure):
-                    if res[1].trap(IOError) is IOError:
-                        return True
-            return False
+            return results == [(True, "Testing, testing, 123... " * 100)]
 
         return q.scheduleRead(fd, 0, 1, 4096 * 4096).addBoth(_defaultCallback).addBoth(self._shutdown, fd)
 
@@ -75,6 +93,609 @@ class TestAio(unittest.TestCase):
             return False
         return q.scheduleRead(fd, 0, 1, 40).addCallbacks(_defaultCallback, _defaultErrback).addBoth(self._shutdown, fd)
 
+    def test_bufferPool(self, *args, **kw):
+        import aio
+        q = aio.Queue(4, bufferSize = 4096, bufferCount = 1)
+        self.assertEquals(q.bufferSize, 4096)
+        self.assertEquals(q.bufferCount, 1)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        def _secondBatch(res):
+            # the buffer used by the first read came back to the pool
+            self.assertEquals((q.poolHits, q.poolMisses), (1, 0))
+            return q.scheduleRead(fd, 0, 2, 512)
+        def _checkStats(res):
+            self.assertEquals((q.poolHits, q.poolMisses), (2, 1))
+            self.assertEquals(res[0][1][:9], "Testing, ")
+            # widened to two blocks, still fits a pooled buffer
+            return q.scheduleRead(fd, 100, 1, 4096)
+        def _unaligned(res):
+            self.assertEquals(res[0][1][:9], "Testing, ")
+            self.assertEquals((q.poolHits, q.poolMisses), (3, 1))
+            return True
+        return q.scheduleRead(fd, 0, 1, 512).addCallback(_secondBatch).addCallback(_checkStats).addCallback(_unaligned).addBoth(self._shutdown, fd)
+
+    def test_zeroCopy(self, *args, **kw):
+        import aio
+        q = aio.Queue(4, bufferSize = 4096, bufferCount = 1)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        def _check(res):
+            data = res[0][1]
+            self.failUnless(isinstance(data, aio.Buffer))
+            self.assertEquals(len(data), 512)
+            self.assertEquals(buffer(data)[:9], "Testing, ")
+            self.assertEquals(str(data), ("Testing, testing, 123... " * 100)[:512])
+            self.assertEquals((q.poolHits, q.poolMisses), (1, 0))
+            return True
+        return q.scheduleRead(fd, 0, 1, 512, zeroCopy = True).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_write(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDWR | os.O_DIRECT)
+        def _written(res):
+            self.assertEquals(res, 4096)
+            return q.scheduleRead(fd, 4096, 1, 4096)
+        def _check(res):
+            self.assertEquals(res[0][1], "A" * 4096)
+            return True
+        return q.scheduleWrite(fd, 4096, "A" * 4096).addCallback(_written).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_vectored(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDWR | os.O_DIRECT)
+        def _written(res):
+            self.assertEquals(res, 3 * 4096)
+            self.assertEquals(q.busy, 0)
+            return q.scheduleReadv(fd, 4096, [4096, 8192])
+        def _check(res):
+            self.assertEquals(res, ["A" * 4096, "B" * 4096 + "C" * 4096])
+            return True
+        return q.scheduleWritev(fd, 4096, ["A" * 4096, "B" * 4096, "C" * 4096]).addCallback(_written).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_barrier(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDWR | os.O_DIRECT)
+        def _committed(res):
+            self.assertEquals(res, 2 * 4096)
+            self.assertEquals(q.busy, 0)
+            return q.scheduleFsync(fd, dataOnly = True)
+        def _synced(res):
+            self.assertEquals(res, None)
+            return True
+        d = q.scheduleBarrier(fd, [(0, "A" * 4096), (4096, "B" * 4096)])
+        self.assertEquals(q.busy, 3)
+        return d.addCallback(_committed).addCallback(_synced).addBoth(self._shutdown, fd)
+
+    def test_batchRead(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        def _check(res):
+            self.assertEquals(len(res), 4)
+            self.assertEquals("".join(res), ("Testing, testing, 123... " * 100)[:2048])
+            self.assertEquals(q.busy, 0)
+            return True
+        return q.scheduleRead(fd, 0, 4, 512, batch = True).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_shortRead(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        expected = "Testing, testing, 123... " * 100
+        def _last(res):
+            # only the last chunk may stop at the end of file
+            self.assertEquals(res, [expected[:1024], expected[1024:2048], expected[2048:]])
+            return q.scheduleRead(fd, 2048, 2, 512, batch = True).addCallbacks(self.fail, _missing)
+        def _missing(failure):
+            failure.trap(IOError)
+            return q.scheduleReadv(fd, 0, [2048, 1024, 512])
+        def _vectored(res):
+            self.assertEquals(res, [expected[:2048], expected[2048:], ""])
+            self.assertEquals(q.busy, 0)
+            return True
+        d = q.scheduleRead(fd, 0, 3, 1024, batch = True)
+        return d.addCallback(_last).addCallback(_vectored).addBoth(self._shutdown, fd)
+
+    def test_callback(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        d = Deferred()
+        chunks = []
+        def _collect(data):
+            chunks.append(data)
+            if len(chunks) == 3:
+                d.callback(chunks)
+        def _check(res):
+            expected = "Testing, testing, 123... " * 100
+            self.assertEquals(sorted(res), sorted(["", expected[:512], expected[512:1024]]))
+            return True
+        self.assertEquals(q.scheduleRead(fd, 0, 2, 512, callback = _collect), None)
+        q.scheduleRead(fd, 4096, 1, 512, callback = _collect) # beyond end of file
+        return d.addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_reentrantCallback(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        chunks = []
+        def _collect(data):
+            chunks.append(data[:9])
+            # the other completions are delivered from in here
+            while q.busy:
+                q.processEvents(maxEvents = 1, timeoutNSec = 1000000)
+        q.scheduleRead(fd, 0, 4, 512, callback = _collect)
+        while len(chunks) < 4:
+            q.processEvents(maxEvents = 1, timeoutNSec = 1000000)
+        self.assertEquals(len(chunks), 4)
+        self.assertEquals(chunks[0], "Testing, ")
+        os.close(fd)
+        q.stop()
+
+    def test_readInto(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDONLY)
+        target = bytearray(32)
+        def _check(res):
+            self.assertEquals(res, 16)
+            self.assertEquals(str(target[8:24]), "Testing, testing")
+            # the buffer was released, so target can be resized again
+            target.extend("x")
+            return True
+        return q.scheduleReadInto(fd, 0, target, 8, 16).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_largeOffset(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDWR)
+        # past what fits into 32 bits, the file stays sparse
+        offset = (1 << 32) + 4096
+        def _written(res):
+            self.assertEquals(res, 512)
+            return q.scheduleRead(fd, offset, 1, 512)
+        def _check(res):
+            self.assertEquals(res[0][1], "L" * 512)
+            self.assertEquals(os.fstat(fd).st_size, offset + 512)
+            return True
+        return q.scheduleWrite(fd, offset, "L" * 512).addCallback(_written).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_tokens(self, *args, **kw):
+        import aio
+        d = Deferred()
+        batches = []
+        def _handler(completed):
+            batches.append(completed)
+            if sum(map(len, batches)) == 3:
+                d.callback(sorted(sum(batches, [])))
+        q = aio.Queue(completionHandler = _handler)
+        fd = os.open(TEST_FILENAME, os.O_RDWR | os.O_DIRECT)
+        def _check(res):
+            expected = "Testing, testing, 123... " * 100
+            self.assertEquals(res[:2], [("a", 512, expected[:512]), ("b", 512, expected[512:1024])])
+            self.assertEquals(res[2], ("c", 4096, None))
+            return True
+        self.assertEquals(q.scheduleRead(fd, 0, 2, 512, token = ["a", "b"]), None)
+        self.assertEquals(q.scheduleWrite(fd, 4096, "C" * 4096, token = "c"), None)
+        # an explicit None is the same as no token
+        self.failUnless(isinstance(q.scheduleRead(fd, 0, 1, 512, token = None), Deferred))
+        return d.addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_waitForSlots(self, *args, **kw):
+        import aio
+        q = aio.Queue(2)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        q.scheduleRead(fd, 0, 2, 512)
+        fired = []
+        d = q.waitForSlots()
+        d.addCallback(fired.append)
+        self.assertEquals(fired, [])
+        def _refill(res):
+            # the waiter can use its slot right away
+            self.assertEquals(fired[0], q.maxIO - q.busy)
+            self.failUnless(fired[0] >= 1)
+            return q.scheduleRead(fd, 0, 1, 512)
+        def _check(res):
+            self.assertEquals(res[0][1][:9], "Testing, ")
+            return True
+        d.addCallback(_refill)
+        return d.addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_uring(self, *args, **kw):
+        import aio
+        if "uring" not in aio.engines:
+            raise unittest.SkipTest("io_uring is not available")
+        q = aio.Queue(engine = "uring")
+        self.assertEquals(q.engine, "uring")
+        # io_uring does buffered I/O, no alignment needed
+        fd = os.open(TEST_FILENAME, os.O_RDWR)
+        def _written(res):
+            self.assertEquals(res, 5)
+            return q.scheduleRead(fd, 3, 1, 10)
+        def _check(res):
+            self.assertEquals(res[0][1], "tiXXXXXest")
+            return True
+        return q.scheduleWrite(fd, 5, "XXXXX").addCallback(_written).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_queuePool(self, *args, **kw):
+        import aio
+        pool = aio.QueuePool(2, threaded = True)
+        fds = [os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT) for a in range(2)]
+        self.failUnless(pool.queueFor(fds[0]) is pool.queues[fds[0] % 2])
+        def _check(res):
+            for success, result in res:
+                self.assertEquals(result[0][1][:9], "Testing, ")
+            self.assertEquals(pool.busy, 0)
+            pool.stop()
+            os.close(fds[1])
+            return True
+        d = DeferredList([pool.scheduleRead(fd, 0, 1, 512) for fd in fds])
+        return d.addCallback(_check).addBoth(self._shutdown, fds[0])
+
+    def test_threadedSubmit(self, *args, **kw):
+        import aio, threading
+        q = aio.Queue(16)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        d = Deferred()
+        chunks = []
+        def _collect(data):
+            chunks.append(data)
+            if len(chunks) == 16:
+                d.callback(chunks)
+        def _submit():
+            for a in range(4):
+                q.scheduleRead(fd, 0, 1, 512, callback = _collect)
+        threads = [threading.Thread(target = _submit) for a in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        def _check(res):
+            self.assertEquals(len(res), 16)
+            self.assertEquals(q.busy, 0)
+            return True
+        return d.addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_flush(self, *args, **kw):
+        import aio
+        q = aio.Queue(flushThreshold = 8)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        dl = [q.scheduleRead(fd, 0, 1, 512) for a in range(4)]
+        # staged until the end of this reactor iteration
+        self.assertEquals((q.busy, q.submitCalls), (4, 0))
+        def _check(res):
+            self.assertEquals((q.flushes, q.submitCalls, q.submitted), (1, 1, 4))
+            self.assertEquals(q.averageBatchSize, 4.0)
+            self.assertEquals([r[1][0][1][:9] for r in res], ["Testing, "] * 4)
+            return True
+        return DeferredList(dl).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_flushHookCollected(self, *args, **kw):
+        import aio, gc, weakref
+        q = aio.Queue(flushThreshold = 8)
+        # flushHook is a bound method of q, the cycle must be collectable
+        ref = weakref.ref(q)
+        q.stop()
+        del q
+        gc.collect()
+        self.failUnless(ref() is None)
+
+    def test_close(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        d = q.scheduleRead(fd, 0, 1, 512)
+        self.assertRaises(aio.QueueError, q.close)
+        def _check(res):
+            q.stop()
+            q.close()
+            self.assertEquals((q.fd, q.bufferCount), (-1, 0))
+            self.assertRaises(IOError, q.scheduleRead, fd, 0, 1, 512)
+            # closing twice does nothing
+            q.close()
+            return True
+        return d.addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_readScheduler(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        s = aio.ReadScheduler(q, minReadahead = 1024, alignment = 512)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        expected = "Testing, testing, 123... " * 100
+        def _merged(res):
+            self.assertEquals([r[1] for r in res], [expected[:512], expected[512:1024]])
+            self.assertEquals(s.submitted, 1)
+            # sequential, so this one reads ahead
+            return s.read(fd, 1024, 512)
+        def _readahead(res):
+            self.assertEquals(res, expected[1024:1536])
+            return s.read(fd, 1536, 512)
+        def _check(res):
+            self.assertEquals(res, expected[1536:2048])
+            self.assertEquals((s.submitted, s.readaheadHits), (2, 1))
+            # a file opened later under the same number starts afresh
+            s.release(fd)
+            self.assertEquals((len(s.readahead), len(s.streams)), (0, 0))
+            return True
+        d = DeferredList([s.read(fd, 512, 512), s.read(fd, 0, 512)])
+        return d.addCallback(lambda res: [res[1], res[0]]).addCallback(_merged).addCallback(_readahead).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_blockCache(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        c = aio.BlockCache(q, budget = 1024, blockSize = 512)
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        expected = "Testing, testing, 123... " * 100
+        def _coalesced(res):
+            self.assertEquals([r[1] for r in res], [expected[:100], expected[50:150]])
+            self.assertEquals((c.misses, c.coalesced), (1, 1))
+            return c.read(fd, 0, 512)
+        def _hit(res):
+            self.assertEquals(res, expected[:512])
+            self.assertEquals(c.hits, 1)
+            # block 0 was referenced, so block 1 is evicted
+            return c.read(fd, 500, 1000)
+        def _evicted(res):
+            self.assertEquals(res, expected[500:1500])
+            self.assertEquals((c.misses, c.evictions), (3, 1))
+            self.failUnless((0, 512) in [(k[2] * 512, len(b)) for k, (slot, b) in c.entries.items()])
+            # cached blocks are copies, not the queue's buffers
+            self.assertEquals(set(type(b) for slot, b in c.entries.values()), set([str]))
+            self.assertEquals(c.files.keys(), [fd])
+            c.release(fd)
+            self.assertEquals(c.files, {})
+            return True
+        d = DeferredList([c.read(fd, 0, 100), c.read(fd, 50, 100)])
+        return d.addCallback(_coalesced).addCallback(_hit).addCallback(_evicted).addBoth(self._shutdown, fd)
+
+    def test_fileProducer(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        p = aio.FileProducer(q, TEST_FILENAME, chunkSize = 512, window = 2, length = 2000)
+        expected = "Testing, testing, 123... " * 100
+        class Consumer(StubConsumer):
+            def write(self, data):
+                StubConsumer.write(self, data)
+                # never more than the window is read ahead
+                assert p.issued - p.delivered <= 2
+                if len(self.written) == 1:
+                    p.pauseProducing()
+                    reactor.callLater(0.01, p.resumeProducing)
+        c = Consumer()
+        def _check(res):
+            self.assertEquals("".join(c.written), expected[:2000])
+            self.assertEquals(len(c.written), 4)
+            self.failUnless(c.producer is None)
+            q.stop()
+            return True
+        return p.beginProducing(c).addCallback(_check)
+
+    def test_sendFile(self, *args, **kw):
+        import aio, socket
+        q = aio.Queue()
+        from twisted.internet import abstract
+        a, b = socket.socketpair()
+        expected = "Testing, testing, 123... " * 100
+        class Transport(StubConsumer, abstract.FileDescriptor):
+            def __init__(self):
+                StubConsumer.__init__(self)
+                abstract.FileDescriptor.__init__(self)
+            def fileno(self):
+                return a.fileno()
+        t = Transport()
+        def _check(res):
+            received = ""
+            while len(received) < 2048:
+                received += b.recv(4096)
+            self.assertEquals(received, expected[:2048])
+            # everything went through sendfile
+            self.assertEquals(t.written, [])
+            a.close()
+            b.close()
+            q.stop()
+            return True
+        return q.sendFile(t, TEST_FILENAME, length = 2048, chunkSize = 512, window = 2).addCallback(_check)
+
+    def test_sendFileShort(self, *args, **kw):
+        import aio, socket
+        q = aio.Queue()
+        a, b = socket.socketpair()
+        class Transport(StubConsumer):
+            def fileno(self):
+                return a.fileno()
+        t = Transport()
+        def _check(res):
+            a.close()
+            received = ""
+            while True:
+                data = b.recv(4096)
+                if not data:
+                    break
+                received += data
+            # what the file had, and none of the stale staging area
+            self.assertEquals(received + "".join(t.written), "Testing, testing, 123... " * 100)
+            # its buffer can not be checked, so it only got copies
+            self.assertEquals(received, "")
+            b.close()
+            q.stop()
+            return True
+        # as if the file was truncated after the producer was made
+        return q.sendFile(t, TEST_FILENAME, length = 4096, chunkSize = 512, window = 2).addCallback(_check)
+
+    def test_copyFile(self, *args, **kw):
+        import aio
+        # chunks of one 512 byte block, read and written in place
+        q = aio.Queue(alignment = 512)
+        def _check(stats):
+            self.assertEquals(stats["bytes"], 2500)
+            self.assertEquals(open(TEST_FILENAME + ".copy").read(), "Testing, testing, 123... " * 100)
+            # five chunks read into pooled buffers, the tail written from a copy
+            self.assertEquals(q.poolHits + q.poolMisses, 6)
+            os.unlink(TEST_FILENAME + ".copy")
+            open(TEST_FILENAME + ".empty", "w").close()
+            return q.copyFile(TEST_FILENAME + ".empty", TEST_FILENAME + ".copy").addCallback(_empty)
+        def _empty(stats):
+            # fired at once, the descriptors are closed
+            self.assertEquals(stats["bytes"], 0)
+            self.assertEquals(os.path.getsize(TEST_FILENAME + ".copy"), 0)
+            self.assertEquals(len(os.listdir("/proc/self/fd")), fds)
+            os.unlink(TEST_FILENAME + ".empty")
+            os.unlink(TEST_FILENAME + ".copy")
+            q.stop()
+            return True
+        fds = len(os.listdir("/proc/self/fd"))
+        return q.copyFile(TEST_FILENAME, TEST_FILENAME + ".copy", chunkSize = 512, depth = 2).addCallback(_check)
+
+    def test_staticFile(self, *args, **kw):
+        import aio
+        from aio.web import StaticAIOFile
+        from twisted.web import http, server
+        q = aio.Queue()
+        resource = StaticAIOFile(os.path.abspath(TEST_FILENAME), queue = q, chunkSize = 512)
+        # children share the queue
+        self.failUnless(resource.createSimilarFile(resource.path).queue is q)
+        expected = "Testing, testing, 123... " * 100
+        class Request(StubConsumer):
+            method = "GET"
+            def __init__(self, range):
+                StubConsumer.__init__(self)
+                self.headers = {"range": range}
+                self.responseHeaders = {}
+                self.code = 200
+                self.finished = Deferred()
+            def getHeader(self, name):
+                return self.headers.get(name)
+            def setHeader(self, name, value):
+                self.responseHeaders[name] = value
+            def setResponseCode(self, code):
+                self.code = code
+            def setLastModified(self, when):
+                pass
+            def setETag(self, tag):
+                pass
+            def notifyFinish(self):
+                return Deferred()
+            def finish(self):
+                self.finished.callback("".join(self.written))
+        whole, single, multi, bad = (Request(None), Request("bytes=1000-1099"),
+                                     Request("bytes=2000-,100-199,150-249,0-9"), Request("bytes=3000-"))
+        self.assertEquals(resource.render_GET(bad), "")
+        self.assertEquals(bad.code, http.REQUESTED_RANGE_NOT_SATISFIABLE)
+        self.assertEquals(resource.render_GET(whole), server.NOT_DONE_YET)
+        self.assertEquals(resource.render_GET(single), server.NOT_DONE_YET)
+        self.assertEquals(resource.render_GET(multi), server.NOT_DONE_YET)
+        def _check(res):
+            self.assertEquals(res[0][1], expected)
+            self.assertEquals(single.code, http.PARTIAL_CONTENT)
+            self.assertEquals(single.responseHeaders["content-range"], "bytes 1000-1099/2500")
+            self.assertEquals(res[1][1], expected[1000:1100])
+            # the overlapping ranges were merged
+            boundary = multi.responseHeaders["content-type"].split("boundary=")[1]
+            part = "\r\nContent-Type: text/html\r\nContent-Range: bytes %i-%i/2500\r\n\r\n%s\r\n"
+            self.assertEquals(res[2][1].split("--" + boundary)[1:],
+                              [part % (0, 9, expected[:10]), part % (100, 249, expected[100:250]),
+                               part % (2000, 2499, expected[2000:]), "--\r\n"])
+            self.assertEquals(int(multi.responseHeaders["content-length"]), len(res[2][1]))
+            q.stop()
+            return True
+        return DeferredList([whole.finished, single.finished, multi.finished]).addCallback(_check)
+
+    def test_cancel(self, *args, **kw):
+        import aio
+        from twisted.internet import defer
+        q = aio.Queue(flushThreshold = 8, timeout = 0.05)
+        q.flushHook = None # staged until cancelled
+        q.sweepInterval = 0.01
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        def _expired(f):
+            f.trap(defer.TimeoutError)
+            failures = []
+            d = q.scheduleFsync(fd, timeout = 0)
+            d.cancel()
+            d.addErrback(failures.append)
+            self.failUnless(failures[0].check(defer.CancelledError))
+            self.assertEquals(q.cancel(d), 0)
+            done = Deferred()
+            reactor.callLater(0.01, done.callback, None)
+            return done.addCallback(_check)
+        def _check(res):
+            # neither reached the kernel, and both slots are free again
+            self.assertEquals((q.busy, q.submitted), (0, 0))
+            q.stop()
+            return True
+        return q.scheduleFsync(fd).addCallbacks(lambda _: False, _expired).addBoth(self._shutdown, fd)
+
+    def test_priorityScheduler(self, *args, **kw):
+        import aio
+        q = aio.Queue()
+        s = aio.PriorityScheduler(q, depth = 1)
+        s.addClass("bulk", 1)
+        s.addClass("interactive", 4, aio.ioprio(aio.IOPRIO_CLASS_BE, 0))
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        order = []
+        def _read(name, offset):
+            return s.read(name, fd, offset, 512).addCallback(lambda data: order.append((name, data[:9])))
+        dl = [_read("bulk", a * 512) for a in range(4)] + [_read("interactive", 0) for a in range(4)]
+        def _check(res):
+            # the first bulk read went out alone, then four times the share
+            self.assertEquals([name for name, data in order], ["bulk"] + ["interactive"] * 4 + ["bulk"] * 3)
+            self.assertEquals(order[1][1], "Testing, ")
+            self.assertEquals((s.classes["bulk"].bytes, s.classes["interactive"].bytes), (2048, 2048))
+            self.assertEquals(q.ioprio, 0)
+            q.stop()
+            return True
+        return DeferredList(dl).addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_priorityCancel(self, *args, **kw):
+        import aio
+        from twisted.internet.defer import CancelledError
+        q = aio.Queue()
+        s = aio.PriorityScheduler(q, depth = 1)
+        s.addClass("bulk")
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        cancelled = []
+        submitted, pending, last = [s.read("bulk", fd, a * 512, 512) for a in range(3)]
+        for d in submitted, pending:
+            d.addErrback(lambda f: cancelled.append(f.trap(CancelledError)))
+        # one still waits in the scheduler, the other is in the queue
+        pending.cancel()
+        self.assertEquals(len(s.classes["bulk"].pending), 1)
+        submitted.cancel()
+        def _check(data):
+            self.assertEquals(data, ("Testing, testing, 123... " * 100)[1024:1536])
+            self.assertEquals(cancelled, [CancelledError] * 2)
+            self.assertEquals((s.inflight, s.submitted), (0, {}))
+            q.stop()
+            return True
+        return last.addCallback(_check).addBoth(self._shutdown, fd)
+
+    def test_elasticQueue(self, *args, **kw):
+        import aio
+        q = aio.ElasticQueue(2, maxQueues = 3, growAfter = 0, idleAfter = 0.05)
+        q.checkInterval = 0.01
+        fd = os.open(TEST_FILENAME, os.O_RDONLY | os.O_DIRECT)
+        self.assertRaises(aio.QueueError, q.scheduleRead, fd, 0, 3, 512)
+        # beyond maxIO, contexts are added, then the rest is backlogged
+        dl = [q.scheduleRead(fd, a * 512, 1, 512) for a in range(12)]
+        self.assertEquals((q.busy, len(q.backlog), q.grown), (6, 6, 2))
+        added = q.queues[1:]
+        def _check(res):
+            expected = "Testing, testing, 123... " * 100
+            self.assertEquals([r[1][0][1] for r in res], [expected[a * 512:a * 512 + 512] for a in range(12)])
+            done = Deferred()
+            reactor.callLater(0.2, done.callback, None)
+            return done.addCallback(_idle)
+        def _idle(res):
+            # the added queues were retired again
+            self.assertEquals((len(q.queues), q.retired), (1, 2))
+            # and closed, their contexts went back to the kernel
+            self.assertEquals([a.fd for a in added], [-1, -1])
+            q.stop()
+            return True
+        return DeferredList(dl).addCallback(_check).addBoth(self._shutdown, fd)
+
     def _shutdown(self, res, fd):
         os.close(fd)
         self.assertEquals(True, res, "Error in previous callback/errback.")
\ No newline at end of file
@@ -0,0 +1,161 @@
+"""
+twisted.web resource serving files through aio.Queue, so that slow
+disks do not block the reactor.
+"""
+
+import os, time
+
+from twisted.internet import defer
+from twisted.web import static, http, server
+from twisted.python import log
+
+import aio
+
+class StaticAIOFile(static.File):
+    """
+    static.File reading regular files with KAIO instead of blocking
+    read()s, at most window chunks of chunkSize at a time per request.
+
+    Supports byte ranges (one, or several as multipart/byteranges),
+    If-Modified-Since and ETags. Directories are handled by
+    static.File.
+
+    Without a queue, one is created here and shared by every resource
+    below this one.
+    """
+
+    def __init__(self, path, defaultType = "text/html", ignoredExts = (), registry = None,
+                 allowExt = 0, queue = None, chunkSize = 65536, window = 8):
+        static.File.__init__(self, path, defaultType, ignoredExts, registry, allowExt)
+        if queue is None:
+            queue = aio.Queue()
+        self.queue = queue
+        self.chunkSize = chunkSize
+        self.window = window
+
+    def createSimilarFile(self, path):
+        # like static.File.createSimilarFile, passing the queue on instead
+        # of letting the child create its own
+        f = self.__class__(path, self.defaultType, self.ignoredExts, self.registry,
+                           queue = self.queue, chunkSize = self.chunkSize, window = self.window)
+        f.processors = self.processors
+        f.indexNames = self.indexNames[:]
+        f.childNotFound = self.childNotFound
+        return f
+
+    def render_GET(self, request):
+        self.restat(False)
+        if not self.exists() or self.isdir():
+            return static.File.render_GET(self, request)
+
+        size = self.getsize()
+        mtime = self.getmtime()
+        contentType, encoding = static.getTypeAndEncoding(self.basename(), self.contentTypes,
+                                                          self.contentEncodings, self.defaultType)
+        request.setHeader("accept-ranges", "bytes")
+        if (request.setLastModified(mtime) is http.CACHED or
+            request.setETag('"%x-%x"' % (int(mtime), size)) is http.CACHED):
+            return ""
+        if encoding:
+            request.setHeader("content-encoding", encoding)
+
+        ranges = self.parseRange(request.getHeader("range"), size)
+        if ranges == []:
+            request.setResponseCode(http.REQUESTED_RANGE_NOT_SATISFIABLE)
+            request.setHeader("content-range", "bytes */%i" % size)
+            return ""
+        if ranges is None:
+            parts = [(None, 0, size)]
+            request.setHeader("content-type", contentType)
+            request.setHeader("content-length", str(size))
+        elif len(ranges) == 1:
+            start, end = ranges[0]
+            parts = [(None, start, end - start)]
+            request.setResponseCode(http.PARTIAL_CONTENT)
+            request.setHeader("content-type", contentType)
+            request.setHeader("content-range", "bytes %i-%i/%i" % (start, end - 1, size))
+            request.setHeader("content-length", str(end - start))
+        else:
+            boundary = "%x%x" % (int(time.time() * 1000000), os.getpid())
+            parts = [("\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %i-%i/%i\r\n\r\n" %
+                      (boundary, contentType, start, end - 1, size), start, end - start)
+                     for start, end in ranges]
+            trailer = "\r\n--%s--\r\n" % boundary
+            request.setResponseCode(http.PARTIAL_CONTENT)
+            request.setHeader("content-type", "multipart/byteranges; boundary=%s" % boundary)
+            request.setHeader("content-length",
+                              str(sum([len(h) + n for h, s, n in parts]) + len(trailer)))
+            parts.append((trailer, 0, 0))
+
+        if request.method == "HEAD":
+            return ""
+        lost = []
+        request.notifyFinish().addErrback(lost.append)
+        self._produce(request, parts).addCallbacks(lambda _: request.finish(),
+                                                   lambda f: self._failed(f, request, lost))
+        return server.NOT_DONE_YET
+
+    render_HEAD = render_GET
+
+    def parseRange(self, header, size):
+        """
+        Parse a Range header into a sorted list of (start, end)
+        byte ranges, end exclusive. Overlapping ranges are merged.
+
+        @returns: None if the whole file is to be sent, an empty list
+        if no range is satisfiable.
+        """
+        if not header:
+            return None
+        kind, sep, spec = header.partition("=")
+        if kind.strip().lower() != "bytes" or not sep:
+            return None
+        ranges = []
+        try:
+            for r in spec.split(","):
+                first, sep, last = r.strip().partition("-")
+                if not sep:
+                    return None
+                if not first:
+                    # the last bytes of the file
+                    start, end = max(size - int(last), 0), size
+                else:
+                    start = int(first)
+                    end = last and min(int(last) + 1, size) or size
+                    if last and int(last) < start:
+                        return None
+                if start < end:
+                    ranges.append((start, end))
+        except ValueError:
+            return None
+        ranges.sort()
+        merged = []
+        for start, end in ranges:
+            if merged and start <= merged[-1][1]:
+                merged[-1] = (merged[-1][0], max(end, merged[-1][1]))
+            else:
+                merged.append((start, end))
+        return merged
+
+    def _produce(self, request, parts):
+        # one part after another, each led by its header
+        header, start, length = parts.pop(0)
+        if header:
+            request.write(header)
+        if not length:
+            d = defer.succeed(None)
+        else:
+            producer = aio.FileProducer(self.queue, self.path, self.chunkSize, self.window, start, length)
+            d = producer.beginProducing(request)
+        if parts:
+            d.addCallback(lambda _: self._produce(request, parts))
+        return d
+
+    def _failed(self, f, request, lost):
+        if lost:
+            # the client went away, which stopped the producer
+            return
+        # the headers are out, so dropping the connection is the only
+        # way to tell the client
+        log.err(f)
+        request.transport.loseConnection()
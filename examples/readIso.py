@@ -22,8 +22,18 @@ from twisted.internet import task, reactor
 from twisted.python import log
 import aio
 
-def _done(data):
-    sys.stdout.write('OMG!, readed %.2f MB!\n' % (sum([len(x[1]) for x in data if x[0] is True])/(1024.0 * 1024.0)))
+class _Counter:
+    # consumer counting the bytes; chunks are dropped as they arrive
+    readed = 0
+    def registerProducer(self, producer, streaming):
+        pass
+    def unregisterProducer(self):
+        pass
+    def write(self, data):
+        self.readed += len(data)
+
+def _done(data, counter):
+    sys.stdout.write('OMG!, readed %.2f MB!\n' % (counter.readed / (1024.0 * 1024.0)))
     sys.stdout.flush()
     _shutdown()
 
@@ -36,11 +46,9 @@ def _shutdown(*args, **kw):
 def _prepare():
     task.LoopingCall(sys.stdout.write, 'PING! Just a annoying reminder\n').start(0.5, now=False)
     q = aio.Queue()
-    df = aio.DeferredFile(q, "/home/dotz/6.2-RELEASE-i386-disc1.iso")
-    #task.LoopingCall(df.stats).start(5, now=False)
-    df.defer.addCallbacks(_done, _err)
-    df.start()
-    return df.defer
+    counter = _Counter()
+    producer = aio.FileProducer(q, "/home/dotz/6.2-RELEASE-i386-disc1.iso")
+    return producer.beginProducing(counter).addCallbacks(_done, _err, callbackArgs = (counter,))
     
 log.startLogging(sys.stdout)
 _prepare()